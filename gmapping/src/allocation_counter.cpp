@@ -0,0 +1,129 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#include "allocation_counter.hpp"
+
+#ifdef GMAPPING_COUNT_ALLOCATIONS
+
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+
+thread_local size_t allocations = 0;
+
+void * countedAlloc(size_t size)
+{
+  ++allocations;
+  if (size == 0) {
+    size = 1;
+  }
+  while (true) {
+    if (void * p = std::malloc(size)) {
+      return p;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (!handler) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+}  // namespace
+
+void * operator new(size_t size)
+{
+  return countedAlloc(size);
+}
+
+void * operator new[](size_t size)
+{
+  return countedAlloc(size);
+}
+
+void * operator new(size_t size, const std::nothrow_t &) noexcept
+{
+  try {
+    return countedAlloc(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void * operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+  try {
+    return countedAlloc(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void operator delete(void * p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void * p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void * p, size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void * p, size_t) noexcept
+{
+  std::free(p);
+}
+
+namespace allocation_counter
+{
+
+bool enabled()
+{
+  return true;
+}
+
+size_t count()
+{
+  return allocations;
+}
+
+}  // namespace allocation_counter
+
+#else
+
+namespace allocation_counter
+{
+
+bool enabled()
+{
+  return false;
+}
+
+size_t count()
+{
+  return 0;
+}
+
+}  // namespace allocation_counter
+
+#endif  // GMAPPING_COUNT_ALLOCATIONS
@@ -0,0 +1,35 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#ifndef ALLOCATION_COUNTER_HPP_
+#define ALLOCATION_COUNTER_HPP_
+
+#include <cstddef>
+
+/*
+ * Heap allocations made by the calling thread. The global operator new is only
+ * replaced when the package is configured with -DGMAPPING_COUNT_ALLOCATIONS=ON;
+ * otherwise the count stays at zero and enabled() is false.
+ */
+namespace allocation_counter
+{
+
+bool enabled();
+size_t count();
+
+}  // namespace allocation_counter
+
+#endif  // ALLOCATION_COUNTER_HPP_
@@ -0,0 +1,123 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+/*
+ * Maps a list of rosbag2 recordings in one process. Every bag gets its own
+ * SlamGMapping session (processor, random state and TF buffer) in its own
+ * namespace; at most --jobs of them run at once, which bounds peak memory.
+ */
+
+#include <rclcpp/rclcpp.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "slam_gmapping.hpp"
+#include "thread_pool.hpp"
+
+void print_usage()
+{
+  std::cout << "Usage: slam_gmapping_batch [options] <bag>... [--ros-args ...]" << std::endl <<
+    "Options:" << std::endl <<
+    "  --help                 Print help messages" << std::endl <<
+    "  --jobs <n>             number of bags mapped at once (default: one per core)" <<
+    std::endl <<
+    "  --scan_topic <topic>   topic that contains the LaserScan in the bags (default: /scan)" <<
+    std::endl <<
+    "  --output_dir <dir>     where <bag name>.pgm/.yaml are written (default: .)" <<
+    std::endl <<
+    "Parameters given with --ros-args -p apply to every session." << std::endl;
+}
+
+// Name of the bag without its directory, used for the map files
+std::string bagName(std::string bag)
+{
+  while (bag.size() > 1 && bag.back() == '/') {
+    bag.pop_back();
+  }
+  const size_t slash = bag.find_last_of('/');
+  return slash == std::string::npos ? bag : bag.substr(slash + 1);
+}
+
+int main(int argc, char ** argv)
+{
+  setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+  rclcpp::init(argc, argv);
+
+  unsigned int jobs = std::max(1u, std::thread::hardware_concurrency());
+  std::string scan_topic = "/scan";
+  std::string output_dir = ".";
+  std::vector<std::string> bags;
+  std::vector<std::string> args = rclcpp::remove_ros_arguments(argc, argv);
+  for (size_t i = 1; i < args.size(); ++i) {
+    if (args[i] == "--help") {
+      print_usage();
+      rclcpp::shutdown();
+      return 0;
+    } else if (i + 1 < args.size() && args[i] == "--jobs") {
+      jobs = std::max(1, std::stoi(args[++i]));
+    } else if (i + 1 < args.size() && args[i] == "--scan_topic") {
+      scan_topic = args[++i];
+    } else if (i + 1 < args.size() && args[i] == "--output_dir") {
+      output_dir = args[++i];
+    } else if (args[i].compare(0, 2, "--") == 0) {
+      std::cerr << "ERROR: unknown or incomplete option '" << args[i] << "'" << std::endl;
+      print_usage();
+      rclcpp::shutdown();
+      return -1;
+    } else {
+      bags.push_back(args[i]);
+    }
+  }
+  if (bags.empty()) {
+    std::cerr << "ERROR: no bags given" << std::endl;
+    print_usage();
+    rclcpp::shutdown();
+    return -1;
+  }
+
+  auto logger = rclcpp::get_logger("slam_gmapping_batch");
+  std::atomic<size_t> failed{0};
+  ThreadPool pool(std::min<size_t>(jobs, bags.size()));
+  pool.parallelFor(bags.size(), [&](size_t i, unsigned int) {
+      const std::string & bag = bags[i];
+      const std::string path_base = output_dir + "/" + bagName(bag);
+      try {
+        // A namespace per session keeps the map topics of the sessions apart
+        auto options = rclcpp::NodeOptions().arguments(
+          {"--ros-args", "-r", "__ns:=/batch_" + std::to_string(i)});
+        auto node = std::make_shared<SlamGMapping>(options, false);
+        node->startReplay(bag, scan_topic);
+        if (!node->saveMap(path_base)) {
+          throw std::runtime_error("no map to save");
+        }
+        RCLCPP_INFO(logger, "Mapped %s into %s.pgm", bag.c_str(), path_base.c_str());
+      } catch (const std::exception & e) {
+        RCLCPP_ERROR(logger, "Mapping %s failed: %s", bag.c_str(), e.what());
+        failed++;
+      }
+    });
+
+  RCLCPP_INFO(logger, "Mapped %zu of %zu bags", bags.size() - failed, bags.size());
+  rclcpp::shutdown();
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#include "beam_filter.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+void BeamFilter::configure(const std::vector<double> & angles, const Parameters & parameters)
+{
+  parameters_ = parameters;
+  parameters_.bin_size = std::max(1u, parameters_.bin_size);
+  parameters_.max_gap = std::max(1u, parameters_.max_gap);
+  input_count_ = angles.size();
+
+  // A partial last bin still gets its own beam
+  const size_t count = (input_count_ + parameters_.bin_size - 1) / parameters_.bin_size;
+  angles_.resize(count);
+  cos_.resize(count);
+  sin_.resize(count);
+  binned_.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    // The middle of the bin's first and last beam
+    const size_t begin = i * parameters_.bin_size;
+    const size_t end = std::min(begin + parameters_.bin_size, input_count_);
+    angles_[i] = 0.5 * (angles[begin] + angles[end - 1]);
+    cos_[i] = std::cos(angles_[i]);
+    sin_[i] = std::sin(angles_[i]);
+  }
+}
+
+void BeamFilter::apply(const double * ranges, double * out)
+{
+  const double no_return = parameters_.no_return;
+  const size_t count = angles_.size();
+  const bool adaptive = parameters_.feature_threshold > 0.0;
+  // Adaptive decimation looks at the neighbours, so it needs all bins first
+  double * binned = adaptive ? binned_.data() : out;
+  for (size_t i = 0; i < count; ++i) {
+    const size_t begin = i * parameters_.bin_size;
+    const size_t end = std::min(begin + parameters_.bin_size, input_count_);
+    // NaN never compares less, so it reads as no return
+    double range = no_return;
+    for (size_t j = begin; j < end; ++j) {
+      if (ranges[j] < range) {
+        range = ranges[j];
+      }
+    }
+    if (parameters_.drop_unusable && range > parameters_.usable_range) {
+      range = no_return;
+    }
+    binned[i] = range;
+  }
+  if (!adaptive) {
+    return;
+  }
+
+  unsigned int gap = 0;
+  for (size_t i = 0; i < count; ++i) {
+    out[i] = no_return;
+    if (binned[i] >= no_return) {
+      continue;
+    }
+    if (++gap >= parameters_.max_gap || isFeature(binned, i)) {
+      out[i] = binned[i];
+      gap = 0;
+    }
+  }
+}
+
+bool BeamFilter::isFeature(const double * ranges, size_t i) const
+{
+  // The end of a return is an edge
+  if (i == 0 || i + 1 == angles_.size() ||
+    ranges[i - 1] >= parameters_.no_return || ranges[i + 1] >= parameters_.no_return)
+  {
+    return true;
+  }
+  const double ax = ranges[i - 1] * cos_[i - 1];
+  const double ay = ranges[i - 1] * sin_[i - 1];
+  const double bx = ranges[i + 1] * cos_[i + 1] - ax;
+  const double by = ranges[i + 1] * sin_[i + 1] - ay;
+  const double px = ranges[i] * cos_[i] - ax;
+  const double py = ranges[i] * sin_[i] - ay;
+  // Distance of the endpoint from the chord, compared squared
+  const double cross = bx * py - by * px;
+  const double threshold = parameters_.feature_threshold;
+  return cross * cross > threshold * threshold * (bx * bx + by * by);
+}
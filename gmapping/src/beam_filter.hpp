@@ -0,0 +1,75 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#ifndef BEAM_FILTER_HPP_
+#define BEAM_FILTER_HPP_
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * Reduces the beams of a laser before they reach GMapping.
+ *
+ * Consecutive beams are binned into one whose range is the shortest of the bin,
+ * so the nearest obstacle in every direction is kept. Beams can then be dropped
+ * when they are beyond the usable range or, with adaptive decimation, when their
+ * endpoint lies on the straight line through its neighbours' endpoints; beams on
+ * corners, edges and other features are always kept and a flat stretch keeps one
+ * beam in every max_gap. A dropped beam is written as no return, so it is neither
+ * matched nor registered in the map.
+ */
+class BeamFilter
+{
+public:
+  struct Parameters
+  {
+    // Number of input beams binned into one
+    unsigned int bin_size = 1;
+    // Drop beams longer than usable_range
+    bool drop_unusable = false;
+    double usable_range = 0.0;
+    // Endpoints farther than feature_threshold from the line through their neighbours'
+    // endpoints are features [m]; zero disables adaptive decimation
+    double feature_threshold = 0.0;
+    unsigned int max_gap = 1;
+    // Range written for beams without a return
+    double no_return = 0.0;
+  };
+
+  // angles are the input beam directions, evenly spaced in increasing order
+  void configure(const std::vector<double> & angles, const Parameters & parameters);
+
+  // Directions of the filtered beams
+  const std::vector<double> & angles() const {return angles_;}
+  size_t beamCount() const {return angles_.size();}
+
+  // Filters one scan of the configured number of input beams, in the order of the
+  // input angles, into beamCount() ranges
+  void apply(const double * ranges, double * out);
+
+private:
+  bool isFeature(const double * ranges, size_t i) const;
+
+  Parameters parameters_;
+  size_t input_count_ = 0;
+  std::vector<double> angles_;
+  std::vector<double> cos_;
+  std::vector<double> sin_;
+  // Binned ranges of the scan being decimated
+  std::vector<double> binned_;
+};
+
+#endif  // BEAM_FILTER_HPP_
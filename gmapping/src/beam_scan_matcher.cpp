@@ -0,0 +1,262 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+/*
+ * optimize() and score() follow ScanMatcher::optimize() in scanmatcher.cpp and
+ * ScanMatcher::score() in scanmatcher.h of OpenSLAM GMapping.
+ */
+
+#include "beam_scan_matcher.hpp"
+
+#include <cmath>
+
+void BeamScanMatcher::configure(const GMapping::ScanMatcher & matcher)
+{
+  laser_pose_ = matcher.getlaserPose();
+  usable_range_ = matcher.getusableRange();
+  gaussian_sigma_ = matcher.getgaussianSigma();
+  kernel_size_ = matcher.getkernelSize();
+  opt_linear_delta_ = matcher.getoptLinearDelta();
+  opt_angular_delta_ = matcher.getoptAngularDelta();
+  opt_recursive_iterations_ = matcher.getoptRecursiveIterations();
+  fullness_threshold_ = matcher.getfullnessThreshold();
+  free_cell_ratio_ = matcher.getfreeCellRatio();
+  angular_odometry_reliability_ = matcher.getangularOdometryReliability();
+  linear_odometry_reliability_ = matcher.getlinearOdometryReliability();
+
+  // The library scores one beam in likelihoodSkip + 1, starting after the initial skip
+  beam_index_.clear();
+  beam_cos_.clear();
+  beam_sin_.clear();
+  const unsigned int likelihood_skip = matcher.getlikelihoodSkip();
+  unsigned int skip = 0;
+  for (unsigned int i = matcher.getinitialBeamsSkip(); i < matcher.laserBeams(); ++i) {
+    skip++;
+    skip = skip > likelihood_skip ? 0 : skip;
+    if (skip) {
+      continue;
+    }
+    beam_index_.push_back(i);
+    beam_cos_.push_back(std::cos(matcher.laserAngles()[i]));
+    beam_sin_.push_back(std::sin(matcher.laserAngles()[i]));
+  }
+}
+
+double BeamScanMatcher::optimize(
+  GMapping::OrientedPoint & pnew,
+  const GMapping::ScanMatcherMap & map, const GMapping::OrientedPoint & init,
+  const double * readings) const
+{
+  double best_score = -1;
+  GMapping::OrientedPoint current_pose = init;
+  double current_score = score(map, current_pose, readings);
+  double adelta = opt_angular_delta_;
+  double ldelta = opt_linear_delta_;
+  unsigned int refinement = 0;
+  do {
+    if (best_score >= current_score) {
+      refinement++;
+      adelta *= .5;
+      ldelta *= .5;
+    }
+    best_score = current_score;
+    GMapping::OrientedPoint best_local_pose = current_pose;
+    for (int move = Front; move != Done; ++move) {
+      const GMapping::OrientedPoint local_pose = movedPose(current_pose, move, ldelta, adelta);
+      double local_score = odometryGain(init, local_pose) * score(map, local_pose, readings);
+      if (local_score > current_score) {
+        current_score = local_score;
+        best_local_pose = local_pose;
+      }
+    }
+    current_pose = best_local_pose;
+  } while (current_score > best_score || refinement < opt_recursive_iterations_);
+  pnew = current_pose;
+  return best_score;
+}
+
+void BeamScanMatcher::optimizeBatch(BatchSearch & search, const BatchScore & score) const
+{
+  // The loop of optimize() turned inside out: every pass of the outer loop generates the
+  // moves of all searches still running, scores them together and then takes the best
+  // move of each search in the order optimize() tries them
+  const size_t count = search.init.size();
+  search.pose = search.init;
+  search.score.assign(count, -1);
+  search.candidates.clear();
+  for (size_t i = 0; i < count; ++i) {
+    search.candidates.push_back({static_cast<unsigned int>(i), search.init[i]});
+  }
+  score(search.candidates, search.candidate_scores);
+  search.states.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    search.states[i] = {search.candidate_scores[i], opt_angular_delta_, opt_linear_delta_, 0, true};
+  }
+
+  bool running = count > 0;
+  while (running) {
+    search.candidates.clear();
+    for (size_t i = 0; i < count; ++i) {
+      BatchSearch::State & state = search.states[i];
+      if (!state.active) {
+        continue;
+      }
+      if (search.score[i] >= state.current_score) {
+        state.refinement++;
+        state.adelta *= .5;
+        state.ldelta *= .5;
+      }
+      search.score[i] = state.current_score;
+      for (int move = Front; move != Done; ++move) {
+        search.candidates.push_back({static_cast<unsigned int>(i),
+            movedPose(search.pose[i], move, state.ldelta, state.adelta)});
+      }
+    }
+    score(search.candidates, search.candidate_scores);
+
+    // Every running search has one candidate per move, Front to TurnRight
+    running = false;
+    for (size_t c = 0; c < search.candidates.size(); c += Done) {
+      const unsigned int i = search.candidates[c].search;
+      BatchSearch::State & state = search.states[i];
+      GMapping::OrientedPoint best_local_pose = search.pose[i];
+      for (int move = Front; move != Done; ++move) {
+        const GMapping::OrientedPoint & local_pose = search.candidates[c + move].pose;
+        double local_score = odometryGain(search.init[i], local_pose) *
+          search.candidate_scores[c + move];
+        if (local_score > state.current_score) {
+          state.current_score = local_score;
+          best_local_pose = local_pose;
+        }
+      }
+      search.pose[i] = best_local_pose;
+      state.active = state.current_score > search.score[i] ||
+        state.refinement < opt_recursive_iterations_;
+      running = running || state.active;
+    }
+  }
+}
+
+GMapping::OrientedPoint BeamScanMatcher::movedPose(
+  const GMapping::OrientedPoint & pose, int move,
+  double ldelta, double adelta)
+{
+  GMapping::OrientedPoint moved = pose;
+  switch (move) {
+    case Front:
+      moved.x += ldelta;
+      break;
+    case Back:
+      moved.x -= ldelta;
+      break;
+    case Left:
+      moved.y -= ldelta;
+      break;
+    case Right:
+      moved.y += ldelta;
+      break;
+    case TurnLeft:
+      moved.theta += adelta;
+      break;
+    case TurnRight:
+      moved.theta -= adelta;
+      break;
+    default:
+      break;
+  }
+  return moved;
+}
+
+double BeamScanMatcher::odometryGain(
+  const GMapping::OrientedPoint & init,
+  const GMapping::OrientedPoint & pose) const
+{
+  double odo_gain = 1;
+  if (angular_odometry_reliability_ > 0.) {
+    double dth = init.theta - pose.theta;
+    dth = atan2(sin(dth), cos(dth));
+    dth *= dth;
+    odo_gain *= exp(-angular_odometry_reliability_ * dth);
+  }
+  if (linear_odometry_reliability_ > 0.) {
+    double dx = init.x - pose.x;
+    double dy = init.y - pose.y;
+    double drho = dx * dx + dy * dy;
+    odo_gain *= exp(-linear_odometry_reliability_ * drho);
+  }
+  return odo_gain;
+}
+
+double BeamScanMatcher::score(
+  const GMapping::ScanMatcherMap & map,
+  const GMapping::OrientedPoint & p, const double * readings) const
+{
+  double s = 0;
+  GMapping::OrientedPoint lp = p;
+  lp.x += cos(p.theta) * laser_pose_.x - sin(p.theta) * laser_pose_.y;
+  lp.y += sin(p.theta) * laser_pose_.x + cos(p.theta) * laser_pose_.y;
+  lp.theta += laser_pose_.theta;
+  const double cos_lp = cos(lp.theta);
+  const double sin_lp = sin(lp.theta);
+  const double free_delta = map.getDelta() * free_cell_ratio_;
+
+  const size_t beams = beam_index_.size();
+  for (size_t k = 0; k < beams; ++k) {
+    const double r = readings[beam_index_[k]];
+    if (r > usable_range_ || r == 0.0) {
+      continue;
+    }
+    // cos and sin of lp.theta + beam angle
+    const double dir_x = cos_lp * beam_cos_[k] - sin_lp * beam_sin_[k];
+    const double dir_y = sin_lp * beam_cos_[k] + cos_lp * beam_sin_[k];
+
+    GMapping::Point phit = lp;
+    phit.x += r * dir_x;
+    phit.y += r * dir_y;
+    const GMapping::IntPoint iphit = map.world2map(phit);
+    GMapping::Point pfree = lp;
+    pfree.x += (r - map.getDelta() * free_delta) * dir_x;
+    pfree.y += (r - map.getDelta() * free_delta) * dir_y;
+    pfree = pfree - phit;
+    const GMapping::IntPoint ipfree = map.world2map(pfree);
+
+    bool found = false;
+    GMapping::Point best_mu(0., 0.);
+    for (int xx = -kernel_size_; xx <= kernel_size_; xx++) {
+      for (int yy = -kernel_size_; yy <= kernel_size_; yy++) {
+        const GMapping::IntPoint pr = iphit + GMapping::IntPoint(xx, yy);
+        const GMapping::IntPoint pf = pr + ipfree;
+        const GMapping::PointAccumulator & cell = map.cell(pr);
+        const GMapping::PointAccumulator & fcell = map.cell(pf);
+        if (static_cast<double>(cell) > fullness_threshold_ &&
+          static_cast<double>(fcell) < fullness_threshold_)
+        {
+          const GMapping::Point mu = phit - cell.mean();
+          if (!found) {
+            best_mu = mu;
+            found = true;
+          } else {
+            best_mu = (mu * mu) < (best_mu * best_mu) ? mu : best_mu;
+          }
+        }
+      }
+    }
+    if (found) {
+      s += exp(-1. / gaussian_sigma_ * best_mu * best_mu);
+    }
+  }
+  return s;
+}
@@ -0,0 +1,120 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#ifndef BEAM_SCAN_MATCHER_HPP_
+#define BEAM_SCAN_MATCHER_HPP_
+
+/* OpenSLAM GMapping */
+#include <gmapping/scanmatcher/scanmatcher.h>
+
+#include <functional>
+#include <vector>
+
+/*
+ * ScanMatcher::optimize() and score() over a table of beam directions.
+ *
+ * The library evaluates cos() and sin() of every beam for every candidate pose
+ * and walks the likelihood skip pattern beam by beam. Here the beams that are
+ * scored and their directions are tabulated once per laser, stored as separate
+ * cos and sin arrays, and a candidate pose only costs one sin/cos pair; the beam
+ * directions follow from the angle sum identities. The hit search around each
+ * endpoint is the library's, so the scores agree up to rounding.
+ *
+ * optimizeBatch() runs the same search for many poses in lock step and hands the
+ * candidates of every step to a scorer in one call, e.g. to score them on a device.
+ */
+class BeamScanMatcher
+{
+public:
+  // A candidate pose of one of the searches of optimizeBatch()
+  struct Candidate
+  {
+    unsigned int search;
+    GMapping::OrientedPoint pose;
+  };
+  // Fills scores with score() of every candidate, in order
+  using BatchScore =
+    std::function<void(const std::vector<Candidate> & candidates, std::vector<double> & scores)>;
+
+  // Searches of optimizeBatch(), kept by the caller so their buffers are reused
+  struct BatchSearch
+  {
+    // Initial poses, set by the caller
+    std::vector<GMapping::OrientedPoint> init;
+    // Matched poses and scores, as optimize() returns them
+    std::vector<GMapping::OrientedPoint> pose;
+    std::vector<double> score;
+
+    struct State
+    {
+      double current_score;
+      double adelta;
+      double ldelta;
+      unsigned int refinement;
+      bool active;
+    };
+    std::vector<State> states;
+    std::vector<Candidate> candidates;
+    std::vector<double> candidate_scores;
+  };
+
+  // Takes the laser and matching parameters of matcher; call again after changing them
+  void configure(const GMapping::ScanMatcher & matcher);
+
+  // Same contract as ScanMatcher::optimize()
+  double optimize(
+    GMapping::OrientedPoint & pnew, const GMapping::ScanMatcherMap & map,
+    const GMapping::OrientedPoint & init, const double * readings) const;
+  // Same contract as ScanMatcher::score()
+  double score(
+    const GMapping::ScanMatcherMap & map, const GMapping::OrientedPoint & p,
+    const double * readings) const;
+  // optimize() from every pose in search.init, with each step of all searches scored
+  // by one call of score
+  void optimizeBatch(BatchSearch & search, const BatchScore & score) const;
+
+private:
+  friend class CudaScanScorer;
+
+  enum Move {Front, Back, Left, Right, TurnLeft, TurnRight, Done};
+
+  static GMapping::OrientedPoint movedPose(
+    const GMapping::OrientedPoint & pose, int move,
+    double ldelta, double adelta);
+  double odometryGain(
+    const GMapping::OrientedPoint & init,
+    const GMapping::OrientedPoint & pose) const;
+
+  // Scored beams: reading index and direction in the laser frame
+  std::vector<unsigned int> beam_index_;
+  std::vector<double> beam_cos_;
+  std::vector<double> beam_sin_;
+
+  GMapping::OrientedPoint laser_pose_;
+  double usable_range_ = 0.0;
+  double gaussian_sigma_ = 0.0;
+  int kernel_size_ = 0;
+  double opt_linear_delta_ = 0.0;
+  double opt_angular_delta_ = 0.0;
+  unsigned int opt_recursive_iterations_ = 0;
+  double fullness_threshold_ = 0.0;
+  double free_cell_ratio_ = 0.0;
+  double angular_odometry_reliability_ = 0.0;
+  double linear_odometry_reliability_ = 0.0;
+};
+
+#endif  // BEAM_SCAN_MATCHER_HPP_
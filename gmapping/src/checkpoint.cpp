@@ -0,0 +1,256 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#include "checkpoint.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace
+{
+
+using Patch = GMapping::Array2D<GMapping::PointAccumulator>;
+using PatchPtr = GMapping::autoptr<Patch>;
+using PatchGrid = GMapping::Array2D<PatchPtr>;
+
+const char kMagic[8] = {'G', 'M', 'A', 'P', 'C', 'K', 'P', 'T'};
+const uint32_t kVersion = 1;
+
+template<typename T>
+void put(std::ostream & out, const T & value)
+{
+  out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template<typename T>
+bool get(std::istream & in, T & value)
+{
+  return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+}
+
+void putVarint(std::ostream & out, uint32_t value)
+{
+  while (value >= 0x80) {
+    out.put(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.put(static_cast<char>(value));
+}
+
+bool getVarint(std::istream & in, uint32_t & value)
+{
+  value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    const int byte = in.get();
+    if (byte == std::char_traits<char>::eof()) {
+      return false;
+    }
+    value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void putPose(std::ostream & out, const GMapping::OrientedPoint & pose)
+{
+  put(out, pose.x);
+  put(out, pose.y);
+  put(out, pose.theta);
+}
+
+bool getPose(std::istream & in, GMapping::OrientedPoint & pose)
+{
+  return get(in, pose.x) && get(in, pose.y) && get(in, pose.theta);
+}
+
+// A map with the cell and patch layout a checkpoint describes. Half a cell short of the
+// far edge, so rounding cannot add a row or column.
+std::unique_ptr<GMapping::ScanMatcherMap> makeMap(
+  const GMapping::Point & center, const GMapping::Point & origin,
+  int size_x, int size_y, double delta)
+{
+  return std::make_unique<GMapping::ScanMatcherMap>(
+    center, origin.x, origin.y,
+    origin.x + (size_x - 0.5) * delta, origin.y + (size_y - 0.5) * delta, delta);
+}
+
+}  // namespace
+
+std::unique_ptr<GMapping::ScanMatcherMap> cloneMap(const GMapping::ScanMatcherMap & map)
+{
+  auto clone = makeMap(
+    map.getCenter(), map.map2world(GMapping::IntPoint(0, 0)),
+    map.getMapSizeX(), map.getMapSizeY(), map.getDelta());
+
+  const PatchGrid & patches = map.storage();
+  const int magnitude = map.storage().getPatchMagnitude();
+  const int patch_size = 1 << magnitude;
+  for (int x = 0; x < patches.getXSize(); ++x) {
+    for (int y = 0; y < patches.getYSize(); ++y) {
+      const PatchPtr & patch = patches.cell(x, y);
+      if (!patch) {
+        continue;
+      }
+      // Writing a cell allocates its patch
+      clone->storage().cell(x << magnitude, y << magnitude);
+      Patch & copy = *clone->storage().PatchGrid::cell(x, y);
+      for (int i = 0; i < patch_size; ++i) {
+        for (int j = 0; j < patch_size; ++j) {
+          copy.cell(i, j) = (*patch).cell(i, j);
+        }
+      }
+    }
+  }
+  return clone;
+}
+
+bool writeCheckpoint(
+  const std::string & path, const GMapping::ScanMatcherMap & map,
+  const GMapping::OrientedPoint & pose, const GMapping::OrientedPoint & odom_pose)
+{
+  const std::string tmp_path = path + ".tmp";
+  std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    return false;
+  }
+
+  const PatchGrid & patches = map.storage();
+  const int magnitude = map.storage().getPatchMagnitude();
+  const int patch_size = 1 << magnitude;
+  int32_t patch_count = 0;
+  for (int x = 0; x < patches.getXSize(); ++x) {
+    for (int y = 0; y < patches.getYSize(); ++y) {
+      if (patches.cell(x, y)) {
+        patch_count++;
+      }
+    }
+  }
+
+  out.write(kMagic, sizeof(kMagic));
+  put(out, kVersion);
+  putPose(out, pose);
+  putPose(out, odom_pose);
+  // The geometry, so the map can be rebuilt with the same cell and patch layout
+  const GMapping::Point center = map.getCenter();
+  const GMapping::Point origin = map.map2world(GMapping::IntPoint(0, 0));
+  put(out, map.getDelta());
+  put(out, center.x);
+  put(out, center.y);
+  put(out, origin.x);
+  put(out, origin.y);
+  put(out, static_cast<int32_t>(map.getMapSizeX()));
+  put(out, static_cast<int32_t>(map.getMapSizeY()));
+  put(out, static_cast<int32_t>(magnitude));
+  put(out, patch_count);
+
+  for (int x = 0; x < patches.getXSize(); ++x) {
+    for (int y = 0; y < patches.getYSize(); ++y) {
+      const PatchPtr & patch = patches.cell(x, y);
+      if (!patch) {
+        continue;
+      }
+      put(out, static_cast<int32_t>(x));
+      put(out, static_cast<int32_t>(y));
+      for (int i = 0; i < patch_size; ++i) {
+        for (int j = 0; j < patch_size; ++j) {
+          const GMapping::PointAccumulator & cell = (*patch).cell(i, j);
+          putVarint(out, static_cast<uint32_t>(cell.visits));
+          if (cell.visits > 0) {
+            putVarint(out, static_cast<uint32_t>(cell.n));
+          }
+          if (cell.n > 0) {
+            put(out, cell.acc.x);
+            put(out, cell.acc.y);
+          }
+        }
+      }
+    }
+  }
+
+  out.close();
+  if (!out) {
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+  return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+bool readCheckpoint(const std::string & path, Checkpoint & checkpoint)
+{
+  std::ifstream in(path, std::ios::binary);
+  char magic[sizeof(kMagic)];
+  uint32_t version = 0;
+  if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, kMagic, sizeof(kMagic)) ||
+    !get(in, version) || version != kVersion)
+  {
+    return false;
+  }
+
+  double delta;
+  GMapping::Point center;
+  GMapping::Point origin;
+  int32_t size_x, size_y, magnitude, patch_count;
+  if (!getPose(in, checkpoint.pose) || !getPose(in, checkpoint.odom_pose) ||
+    !get(in, delta) || !get(in, center.x) || !get(in, center.y) ||
+    !get(in, origin.x) || !get(in, origin.y) || !get(in, size_x) || !get(in, size_y) ||
+    !get(in, magnitude) || !get(in, patch_count) || delta <= 0.0 || size_x <= 0 || size_y <= 0)
+  {
+    return false;
+  }
+
+  auto map = makeMap(center, origin, size_x, size_y, delta);
+  if (map->getMapSizeX() != size_x || map->getMapSizeY() != size_y ||
+    map->storage().getPatchMagnitude() != magnitude)
+  {
+    return false;
+  }
+
+  PatchGrid & patches = map->storage();
+  const int patch_size = 1 << magnitude;
+  for (int32_t p = 0; p < patch_count; ++p) {
+    int32_t x, y;
+    if (!get(in, x) || !get(in, y) ||
+      x < 0 || y < 0 || x >= patches.getXSize() || y >= patches.getYSize())
+    {
+      return false;
+    }
+    // Writing a cell allocates its patch
+    map->storage().cell(x << magnitude, y << magnitude);
+    Patch & patch = *patches.cell(x, y);
+    for (int i = 0; i < patch_size; ++i) {
+      for (int j = 0; j < patch_size; ++j) {
+        GMapping::PointAccumulator & cell = patch.cell(i, j);
+        uint32_t visits = 0;
+        uint32_t n = 0;
+        if (!getVarint(in, visits) || (visits > 0 && !getVarint(in, n))) {
+          return false;
+        }
+        cell.visits = static_cast<int>(visits);
+        cell.n = static_cast<int>(n);
+        if (n > 0 && (!get(in, cell.acc.x) || !get(in, cell.acc.y))) {
+          return false;
+        }
+      }
+    }
+  }
+
+  checkpoint.map = std::move(map);
+  return true;
+}
@@ -0,0 +1,53 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#ifndef CHECKPOINT_HPP_
+#define CHECKPOINT_HPP_
+
+/* OpenSLAM GMapping */
+#include <gmapping/scanmatcher/smmap.h>
+#include <gmapping/utils/point.h>
+
+#include <memory>
+#include <string>
+
+/*
+ * A mapping session saved to disk: the map of the best particle, its pose and the
+ * odometry pose it was estimated at. The map is stored losslessly, patch by
+ * patch; every cell is its visit and hit counts as LEB128 varints, followed by
+ * the hit point sum for cells with hits, so unseen and free cells take one or
+ * two bytes. Numbers are in host byte order.
+ */
+struct Checkpoint
+{
+  GMapping::OrientedPoint pose;
+  GMapping::OrientedPoint odom_pose;
+  std::unique_ptr<GMapping::ScanMatcherMap> map;
+};
+
+// Streams the checkpoint to path + ".tmp" and renames it over path, so a crash
+// while writing leaves the previous checkpoint intact
+bool writeCheckpoint(
+  const std::string & path, const GMapping::ScanMatcherMap & map,
+  const GMapping::OrientedPoint & pose, const GMapping::OrientedPoint & odom_pose);
+// False if the file cannot be read or is not a checkpoint
+bool readCheckpoint(const std::string & path, Checkpoint & checkpoint);
+// Copy of map with the same layout that shares none of its patches, so it can be handed
+// to another thread; copying a ScanMatcherMap shares the patches through autoptr, whose
+// reference count is not atomic
+std::unique_ptr<GMapping::ScanMatcherMap> cloneMap(const GMapping::ScanMatcherMap & map);
+
+#endif  // CHECKPOINT_HPP_
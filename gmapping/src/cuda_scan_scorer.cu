@@ -0,0 +1,565 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+/*
+ * The scoring kernel follows BeamScanMatcher::score(), which follows
+ * ScanMatcher::score() in scanmatcher.h of OpenSLAM GMapping.
+ */
+
+#include "cuda_scan_scorer.hpp"
+
+#include <cuda_runtime.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+
+using PatchPtr = GMapping::autoptr<CudaScanScorer::Patch>;
+using PatchGrid = GMapping::Array2D<PatchPtr>;
+
+// Threads of the block that scores one candidate, each taking every kBlockSize-th beam
+const int kBlockSize = 128;
+// Distance beyond the scan endpoints of a particle's initial pose kept resident [m]
+const double kWindowMargin = 0.5;
+
+enum CellState : int32_t
+{
+  // occupancy above the fullness threshold
+  kOccupied = 1,
+  // occupancy below it
+  kFree = 2,
+};
+
+struct DeviceCell
+{
+  float mean_x;
+  float mean_y;
+  int32_t state;
+};
+
+// Patches [x0, x0 + cols) x [y0, y0 + rows) of a map; their slots start at table, by x then y
+struct PatchWindow
+{
+  int x0, y0, cols, rows;
+  int table;
+};
+
+struct DeviceMap
+{
+  // world2map() of the particle's map
+  double center_x, center_y, delta;
+  int size_x2, size_y2;
+  // size of its patch grid
+  int grid_x, grid_y;
+  // around the scan endpoints, and around the free cells score() checks for them
+  PatchWindow hit, free;
+};
+
+struct DeviceCandidate
+{
+  double x, y, theta;
+  int map;
+};
+
+struct ScoreParameters
+{
+  double laser_x, laser_y, laser_theta;
+  double usable_range;
+  double gaussian_sigma;
+  double free_cell_ratio;
+  int kernel_size;
+  int patch_magnitude;
+  int beams;
+  // whether a cell of no allocated patch reads as free, as Map::cell() does
+  bool unknown_free;
+};
+
+void check(cudaError_t error, const char * what)
+{
+  if (error != cudaSuccess) {
+    throw std::runtime_error(std::string(what) + ": " + cudaGetErrorString(error));
+  }
+}
+
+template<typename T>
+class DeviceBuffer
+{
+public:
+  DeviceBuffer() = default;
+  DeviceBuffer(const DeviceBuffer &) = delete;
+  DeviceBuffer & operator=(const DeviceBuffer &) = delete;
+  ~DeviceBuffer()
+  {
+    cudaFree(data_);
+  }
+
+  // Grows to hold count elements, keeping the contents only if keep
+  void reserve(size_t count, bool keep = false)
+  {
+    if (count <= capacity_) {
+      return;
+    }
+    const size_t capacity = std::max(count, 2 * capacity_);
+    T * data = nullptr;
+    check(cudaMalloc(&data, capacity * sizeof(T)), "cudaMalloc");
+    if (keep && capacity_) {
+      check(cudaMemcpy(data, data_, capacity_ * sizeof(T), cudaMemcpyDeviceToDevice),
+        "cudaMemcpy");
+    }
+    cudaFree(data_);
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+  void upload(const std::vector<T> & host)
+  {
+    reserve(host.size());
+    if (!host.empty()) {
+      check(cudaMemcpy(data_, host.data(), host.size() * sizeof(T), cudaMemcpyHostToDevice),
+        "cudaMemcpy");
+    }
+  }
+
+  // Waits for the kernels writing to the buffer
+  void download(T * host, size_t count) const
+  {
+    if (count) {
+      check(cudaMemcpy(host, data_, count * sizeof(T), cudaMemcpyDeviceToHost), "cudaMemcpy");
+    }
+  }
+
+  T * get() const {return data_;}
+
+private:
+  T * data_ = nullptr;
+  size_t capacity_ = 0;
+};
+
+__device__ int2 world2map(const DeviceMap & map, double x, double y)
+{
+  return make_int2(
+    static_cast<int>(round((x - map.center_x) / map.delta)) + map.size_x2,
+    static_cast<int>(round((y - map.center_y) / map.delta)) + map.size_y2);
+}
+
+// Index of the cell in the patch store, or -1 for a cell of no allocated patch. Sets
+// outside for a cell of the map that is not in the window.
+__device__ long long cellIndex(
+  const DeviceMap & map, const PatchWindow & window, const int * tables,
+  int magnitude, int x, int y, bool & outside)
+{
+  if (x < 0 || y < 0 || (x >> magnitude) >= map.grid_x || (y >> magnitude) >= map.grid_y) {
+    return -1;
+  }
+  const int wx = (x >> magnitude) - window.x0;
+  const int wy = (y >> magnitude) - window.y0;
+  if (wx < 0 || wy < 0 || wx >= window.cols || wy >= window.rows) {
+    outside = true;
+    return -1;
+  }
+  const int slot = tables[window.table + wx * window.rows + wy];
+  if (slot < 0) {
+    return -1;
+  }
+  const int mask = (1 << magnitude) - 1;
+  return (static_cast<long long>(slot) << (2 * magnitude)) +
+         ((x & mask) << magnitude) + (y & mask);
+}
+
+// One block per candidate; scores[i] as BeamScanMatcher::score() of candidate i, and
+// outside[i] set if the candidate read a cell no window of its map holds
+__global__ void scoreCandidates(
+  const DeviceCandidate * candidates, const DeviceMap * maps,
+  const int * tables, const DeviceCell * cells, const double * ranges,
+  const double * beam_cos, const double * beam_sin, ScoreParameters p,
+  double * scores, int * outside)
+{
+  __shared__ double sums[kBlockSize];
+  const DeviceCandidate c = candidates[blockIdx.x];
+  const DeviceMap map = maps[c.map];
+
+  const double lp_x = c.x + cos(c.theta) * p.laser_x - sin(c.theta) * p.laser_y;
+  const double lp_y = c.y + sin(c.theta) * p.laser_x + cos(c.theta) * p.laser_y;
+  const double lp_theta = c.theta + p.laser_theta;
+  const double cos_lp = cos(lp_theta);
+  const double sin_lp = sin(lp_theta);
+  const double free_delta = map.delta * p.free_cell_ratio;
+
+  double s = 0;
+  bool out = false;
+  for (int k = threadIdx.x; k < p.beams; k += blockDim.x) {
+    const double r = ranges[k];
+    if (r > p.usable_range || r == 0.0) {
+      continue;
+    }
+    const double dir_x = cos_lp * beam_cos[k] - sin_lp * beam_sin[k];
+    const double dir_y = sin_lp * beam_cos[k] + cos_lp * beam_sin[k];
+    const double phit_x = lp_x + r * dir_x;
+    const double phit_y = lp_y + r * dir_y;
+    const int2 iphit = world2map(map, phit_x, phit_y);
+    const double pfree_x = lp_x + (r - map.delta * free_delta) * dir_x - phit_x;
+    const double pfree_y = lp_y + (r - map.delta * free_delta) * dir_y - phit_y;
+    const int2 ipfree = world2map(map, pfree_x, pfree_y);
+
+    bool found = false;
+    double best = 0;
+    for (int xx = -p.kernel_size; xx <= p.kernel_size; xx++) {
+      for (int yy = -p.kernel_size; yy <= p.kernel_size; yy++) {
+        const int pr_x = iphit.x + xx;
+        const int pr_y = iphit.y + yy;
+        const long long hit = cellIndex(map, map.hit, tables, p.patch_magnitude, pr_x, pr_y, out);
+        if (hit < 0 || !(cells[hit].state & kOccupied)) {
+          continue;
+        }
+        const long long fcell = cellIndex(map, map.free, tables, p.patch_magnitude,
+            pr_x + ipfree.x, pr_y + ipfree.y, out);
+        if (!(fcell < 0 ? p.unknown_free : (cells[fcell].state & kFree))) {
+          continue;
+        }
+        const double mu_x = phit_x - cells[hit].mean_x;
+        const double mu_y = phit_y - cells[hit].mean_y;
+        const double mu = mu_x * mu_x + mu_y * mu_y;
+        if (!found || mu < best) {
+          best = mu;
+          found = true;
+        }
+      }
+    }
+    if (found) {
+      s += exp(-1. / p.gaussian_sigma * best);
+    }
+  }
+
+  sums[threadIdx.x] = s;
+  const int any_outside = __syncthreads_or(out);
+  for (unsigned int stride = blockDim.x / 2; stride > 0; stride /= 2) {
+    if (threadIdx.x < stride) {
+      sums[threadIdx.x] += sums[threadIdx.x + stride];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    scores[blockIdx.x] = sums[0];
+    outside[blockIdx.x] = any_outside;
+  }
+}
+
+// One block per staged patch, copied to its slot
+__global__ void storePatches(
+  const DeviceCell * staged, const int * slots, int patch_cells,
+  DeviceCell * cells)
+{
+  const long long from = static_cast<long long>(blockIdx.x) * patch_cells;
+  const long long to = static_cast<long long>(slots[blockIdx.x]) * patch_cells;
+  for (int i = threadIdx.x; i < patch_cells; i += blockDim.x) {
+    cells[to + i] = staged[from + i];
+  }
+}
+
+// The patches of storage whose cells lie in [lo, hi], clipped to the patch grid, with
+// their slots appended to table
+template<typename SlotOf>
+PatchWindow patchWindow(
+  const GMapping::HierarchicalArray2D<GMapping::PointAccumulator> & storage,
+  const GMapping::IntPoint & lo, const GMapping::IntPoint & hi,
+  std::vector<int> & table, SlotOf slot_of)
+{
+  const int magnitude = storage.getPatchMagnitude();
+  PatchWindow window;
+  window.x0 = std::max(0, lo.x >> magnitude);
+  window.y0 = std::max(0, lo.y >> magnitude);
+  window.cols = std::max(0, std::min(storage.getXSize() - 1, hi.x >> magnitude) - window.x0 + 1);
+  window.rows = std::max(0, std::min(storage.getYSize() - 1, hi.y >> magnitude) - window.y0 + 1);
+  window.table = static_cast<int>(table.size());
+  for (int x = window.x0; x < window.x0 + window.cols; ++x) {
+    for (int y = window.y0; y < window.y0 + window.rows; ++y) {
+      const PatchPtr & patch = storage.PatchGrid::cell(x, y);
+      table.push_back(patch ? slot_of(&*patch) : -1);
+    }
+  }
+  return window;
+}
+
+}  // namespace
+
+struct CudaScanScorer::Device
+{
+  // Resident patches, (1 << patch magnitude)^2 cells per slot
+  DeviceBuffer<DeviceCell> cells;
+  DeviceBuffer<DeviceCell> staging;
+  DeviceBuffer<int> staging_slots;
+  DeviceBuffer<DeviceMap> maps;
+  DeviceBuffer<int> tables;
+  DeviceBuffer<double> ranges;
+  DeviceBuffer<double> beam_cos;
+  DeviceBuffer<double> beam_sin;
+  DeviceBuffer<DeviceCandidate> candidates;
+  DeviceBuffer<double> scores;
+  DeviceBuffer<int> outside;
+  ScoreParameters parameters;
+
+  // Host side, kept so their capacity is reused
+  std::vector<DeviceCell> staged_cells;
+  std::vector<int> staged_slots;
+  std::vector<DeviceMap> host_maps;
+  std::vector<int> host_tables;
+  std::vector<double> host_ranges;
+  std::vector<DeviceCandidate> host_candidates;
+  std::vector<int> host_outside;
+};
+
+std::shared_ptr<CudaScanScorer> CudaScanScorer::create()
+{
+  int devices = 0;
+  if (cudaGetDeviceCount(&devices) != cudaSuccess || devices == 0) {
+    // clear the error, it would be reported by the next call otherwise
+    cudaGetLastError();
+    return nullptr;
+  }
+  return std::shared_ptr<CudaScanScorer>(new CudaScanScorer());
+}
+
+CudaScanScorer::CudaScanScorer()
+: device_(std::make_unique<Device>())
+{
+}
+
+CudaScanScorer::~CudaScanScorer() = default;
+
+void CudaScanScorer::configure(const BeamScanMatcher & matcher)
+{
+  matcher_ = &matcher;
+  Device & d = *device_;
+  d.beam_cos.upload(matcher.beam_cos_);
+  d.beam_sin.upload(matcher.beam_sin_);
+  ScoreParameters & p = d.parameters;
+  p.laser_x = matcher.laser_pose_.x;
+  p.laser_y = matcher.laser_pose_.y;
+  p.laser_theta = matcher.laser_pose_.theta;
+  p.usable_range = matcher.usable_range_;
+  p.gaussian_sigma = matcher.gaussian_sigma_;
+  p.free_cell_ratio = matcher.free_cell_ratio_;
+  p.kernel_size = matcher.kernel_size_;
+  p.beams = static_cast<int>(matcher.beam_index_.size());
+  p.unknown_free =
+    static_cast<double>(GMapping::PointAccumulator()) < matcher.fullness_threshold_;
+  // the uploaded cell states depend on the fullness threshold
+  clear();
+}
+
+void CudaScanScorer::prepare(
+  const std::vector<const GMapping::ScanMatcherMap *> & maps,
+  const std::vector<GMapping::OrientedPoint> & poses, const double * readings)
+{
+  Device & d = *device_;
+  maps_ = maps;
+  readings_ = readings;
+  epoch_++;
+  used_ = 0;
+  d.staged_cells.clear();
+  d.staged_slots.clear();
+  d.host_maps.clear();
+  d.host_tables.clear();
+
+  const BeamScanMatcher & m = *matcher_;
+  d.host_ranges.clear();
+  for (unsigned int index : m.beam_index_) {
+    d.host_ranges.push_back(readings[index]);
+  }
+
+  auto slot_of = [this](const Patch * patch) {return residentSlot(patch);};
+  for (size_t i = 0; i < maps.size(); ++i) {
+    const GMapping::ScanMatcherMap & map = *maps[i];
+    const auto & storage = map.storage();
+    patch_magnitude_ = storage.getPatchMagnitude();
+
+    // Bounding box of the scored endpoints from the initial pose, as in score()
+    const GMapping::OrientedPoint & p = poses[i];
+    GMapping::OrientedPoint lp = p;
+    lp.x += cos(p.theta) * m.laser_pose_.x - sin(p.theta) * m.laser_pose_.y;
+    lp.y += sin(p.theta) * m.laser_pose_.x + cos(p.theta) * m.laser_pose_.y;
+    lp.theta += m.laser_pose_.theta;
+    const double cos_lp = cos(lp.theta);
+    const double sin_lp = sin(lp.theta);
+    double xmin = lp.x, xmax = lp.x, ymin = lp.y, ymax = lp.y;
+    for (size_t k = 0; k < d.host_ranges.size(); ++k) {
+      const double r = d.host_ranges[k];
+      if (r > m.usable_range_ || r == 0.0) {
+        continue;
+      }
+      const double x = lp.x + r * (cos_lp * m.beam_cos_[k] - sin_lp * m.beam_sin_[k]);
+      const double y = lp.y + r * (sin_lp * m.beam_cos_[k] + cos_lp * m.beam_sin_[k]);
+      xmin = std::min(xmin, x);
+      xmax = std::max(xmax, x);
+      ymin = std::min(ymin, y);
+      ymax = std::max(ymax, y);
+    }
+    const double margin = kWindowMargin + (m.kernel_size_ + 1) * map.getDelta();
+    const GMapping::IntPoint lo = map.world2map(xmin - margin, ymin - margin);
+    const GMapping::IntPoint hi = map.world2map(xmax + margin, ymax + margin);
+    // score() checks the free cell at a hit cell offset by world2map() of a vector
+    // shorter than a cell, i.e. by the cell of the world origin give or take one
+    const GMapping::IntPoint offset = map.world2map(0.0, 0.0);
+    const GMapping::IntPoint one(1, 1);
+
+    DeviceMap dm;
+    dm.center_x = map.getCenter().x;
+    dm.center_y = map.getCenter().y;
+    dm.delta = map.getDelta();
+    const GMapping::IntPoint center = map.world2map(map.getCenter());
+    dm.size_x2 = center.x;
+    dm.size_y2 = center.y;
+    dm.grid_x = storage.getXSize();
+    dm.grid_y = storage.getYSize();
+    dm.hit = patchWindow(storage, lo, hi, d.host_tables, slot_of);
+    dm.free = patchWindow(storage, lo + offset - one, hi + offset + one, d.host_tables, slot_of);
+    d.host_maps.push_back(dm);
+  }
+
+  uploadPatches();
+  d.maps.upload(d.host_maps);
+  d.tables.upload(d.host_tables);
+  d.ranges.upload(d.host_ranges);
+  evictUnused();
+}
+
+void CudaScanScorer::score(
+  const std::vector<BeamScanMatcher::Candidate> & candidates,
+  std::vector<double> & scores)
+{
+  Device & d = *device_;
+  const size_t count = candidates.size();
+  scores.resize(count);
+  if (!count) {
+    return;
+  }
+  d.host_candidates.clear();
+  for (const auto & c : candidates) {
+    d.host_candidates.push_back({c.pose.x, c.pose.y, c.pose.theta, static_cast<int>(c.search)});
+  }
+  d.candidates.upload(d.host_candidates);
+  d.scores.reserve(count);
+  d.outside.reserve(count);
+
+  ScoreParameters p = d.parameters;
+  p.patch_magnitude = patch_magnitude_;
+  scoreCandidates<<<static_cast<unsigned int>(count), kBlockSize>>>(
+    d.candidates.get(), d.maps.get(), d.tables.get(), d.cells.get(), d.ranges.get(),
+    d.beam_cos.get(), d.beam_sin.get(), p, d.scores.get(), d.outside.get());
+  check(cudaGetLastError(), "scoreCandidates");
+  d.scores.download(scores.data(), count);
+  d.host_outside.resize(count);
+  d.outside.download(d.host_outside.data(), count);
+
+  // The search moved so far that the windows do not cover the cells it read
+  for (size_t i = 0; i < count; ++i) {
+    if (d.host_outside[i]) {
+      scores[i] = matcher_->score(*maps_[candidates[i].search], candidates[i].pose, readings_);
+    }
+  }
+}
+
+void CudaScanScorer::invalidate(const Patch * patch)
+{
+  auto it = resident_.find(patch);
+  if (it != resident_.end()) {
+    free_slots_.push_back(it->second.slot);
+    resident_.erase(it);
+  }
+}
+
+void CudaScanScorer::clear()
+{
+  resident_.clear();
+  free_slots_.clear();
+  slot_count_ = 0;
+}
+
+int CudaScanScorer::residentSlot(const Patch * patch)
+{
+  auto it = resident_.find(patch);
+  if (it == resident_.end()) {
+    int slot = slot_count_;
+    if (free_slots_.empty()) {
+      slot_count_++;
+    } else {
+      slot = free_slots_.back();
+      free_slots_.pop_back();
+    }
+    it = resident_.emplace(patch, Resident{slot, 0}).first;
+
+    Device & d = *device_;
+    const double threshold = matcher_->fullness_threshold_;
+    const int patch_size = 1 << patch_magnitude_;
+    for (int x = 0; x < patch_size; ++x) {
+      for (int y = 0; y < patch_size; ++y) {
+        const GMapping::PointAccumulator & cell = patch->cell(x, y);
+        const double occupancy = static_cast<double>(cell);
+        DeviceCell staged = {0.f, 0.f, 0};
+        staged.state = (occupancy > threshold ? kOccupied : 0) | (occupancy < threshold ? kFree : 0);
+        if (cell.n > 0) {
+          const GMapping::Point mean = cell.mean();
+          staged.mean_x = static_cast<float>(mean.x);
+          staged.mean_y = static_cast<float>(mean.y);
+        }
+        d.staged_cells.push_back(staged);
+      }
+    }
+    d.staged_slots.push_back(slot);
+  }
+  if (it->second.used != epoch_) {
+    it->second.used = epoch_;
+    used_++;
+  }
+  return it->second.slot;
+}
+
+void CudaScanScorer::uploadPatches()
+{
+  Device & d = *device_;
+  const int patch_cells = 1 << (2 * patch_magnitude_);
+  d.cells.reserve(static_cast<size_t>(slot_count_) * patch_cells, true);
+  if (d.staged_slots.empty()) {
+    return;
+  }
+  d.staging.upload(d.staged_cells);
+  d.staging_slots.upload(d.staged_slots);
+  storePatches<<<static_cast<unsigned int>(d.staged_slots.size()), kBlockSize>>>(
+    d.staging.get(), d.staging_slots.get(), patch_cells, d.cells.get());
+  check(cudaGetLastError(), "storePatches");
+}
+
+void CudaScanScorer::evictUnused()
+{
+  // Patches no particle is near any more, or that were freed, are forgotten once they
+  // make up half of the store; a particle coming back uploads them again
+  if (resident_.size() <= 2 * used_) {
+    return;
+  }
+  for (auto it = resident_.begin(); it != resident_.end(); ) {
+    if (it->second.used != epoch_) {
+      free_slots_.push_back(it->second.slot);
+      it = resident_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
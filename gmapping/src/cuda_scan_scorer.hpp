@@ -0,0 +1,116 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#ifndef CUDA_SCAN_SCORER_HPP_
+#define CUDA_SCAN_SCORER_HPP_
+
+/* OpenSLAM GMapping */
+#include <gmapping/scanmatcher/smmap.h>
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "beam_scan_matcher.hpp"
+
+/*
+ * BeamScanMatcher::score() of the candidates of all particles on a CUDA device,
+ * as the scorer of BeamScanMatcher::optimizeBatch().
+ *
+ * Map patches stay in device memory between scans, keyed by the patch they were
+ * uploaded from. Particles share most of their patches, so each is uploaded once
+ * for all of them, and after that only the patches the last registrations wrote
+ * to (see invalidate()) and those coming into view are. A cell is uploaded as its
+ * mean hit point in float and its occupancy already compared with the fullness
+ * threshold; the pose and beam geometry are evaluated in double as on the CPU.
+ *
+ * Each particle sees the patches around the endpoints of the scan from its initial
+ * pose. A candidate that reads a cell of the map outside of them is scored again
+ * on the CPU, so the window only bounds the upload, not the search.
+ *
+ * Only compiled with GMAPPING_CUDA; create() is the only member to be called
+ * without checking for it first.
+ */
+class CudaScanScorer
+{
+public:
+  using Patch = GMapping::Array2D<GMapping::PointAccumulator>;
+
+  // A scorer on the current CUDA device, or nullptr if there is none. Held by
+  // shared_ptr so that owners do not need the CUDA code to destroy it.
+  static std::shared_ptr<CudaScanScorer> create();
+  ~CudaScanScorer();
+
+  CudaScanScorer(const CudaScanScorer &) = delete;
+  CudaScanScorer & operator=(const CudaScanScorer &) = delete;
+
+  // Takes the beam geometry and matching parameters of matcher, which must outlive the
+  // scorer, and drops the resident patches
+  void configure(const BeamScanMatcher & matcher);
+  // Makes the maps' patches around poses resident for the scan in readings. Candidate
+  // search numbers index maps, which must stay unchanged until the last score().
+  void prepare(
+    const std::vector<const GMapping::ScanMatcherMap *> & maps,
+    const std::vector<GMapping::OrientedPoint> & poses, const double * readings);
+  // A BeamScanMatcher::BatchScore
+  void score(
+    const std::vector<BeamScanMatcher::Candidate> & candidates,
+    std::vector<double> & scores);
+
+  // The device copy of patch is stale: it was written to, or a new patch may have
+  // taken its address
+  void invalidate(const Patch * patch);
+  // Drops all resident patches
+  void clear();
+  // Patches in device memory
+  size_t residentPatchCount() const {return resident_.size();}
+
+private:
+  struct Device;
+
+  struct Resident
+  {
+    int slot;
+    uint64_t used;
+  };
+
+  CudaScanScorer();
+  // Slot of patch, staged for upload if it is not resident
+  int residentSlot(const Patch * patch);
+  void uploadPatches();
+  void evictUnused();
+
+  // Device buffers and their host side
+  std::unique_ptr<Device> device_;
+  const BeamScanMatcher * matcher_ = nullptr;
+
+  // Device slots of the resident patches and the slots free for reuse
+  std::unordered_map<const Patch *, Resident> resident_;
+  std::vector<int> free_slots_;
+  int slot_count_ = 0;
+  // Counts prepare() calls, and the resident patches the latest one uses
+  uint64_t epoch_ = 0;
+  size_t used_ = 0;
+  int patch_magnitude_ = 0;
+
+  // Of the latest prepare(), for the candidates scored on the CPU
+  std::vector<const GMapping::ScanMatcherMap *> maps_;
+  const double * readings_ = nullptr;
+};
+
+#endif  // CUDA_SCAN_SCORER_HPP_
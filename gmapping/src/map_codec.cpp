@@ -0,0 +1,61 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#include "map_codec.hpp"
+
+void encodeRunLength(const int8_t * cells, size_t count, std::vector<uint8_t> & out)
+{
+  out.clear();
+  size_t i = 0;
+  while (i < count) {
+    const int8_t value = cells[i];
+    size_t run = 1;
+    while (i + run < count && cells[i + run] == value) {
+      run++;
+    }
+    i += run;
+    out.push_back(static_cast<uint8_t>(value));
+    while (run >= 0x80) {
+      out.push_back(static_cast<uint8_t>(run | 0x80));
+      run >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(run));
+  }
+}
+
+bool decodeRunLength(const std::vector<uint8_t> & data, std::vector<int8_t> & cells)
+{
+  cells.clear();
+  size_t i = 0;
+  while (i < data.size()) {
+    const int8_t value = static_cast<int8_t>(data[i++]);
+    size_t run = 0;
+    int shift = 0;
+    while (true) {
+      if (i == data.size() || shift > 56) {
+        return false;
+      }
+      const uint8_t byte = data[i++];
+      run |= static_cast<size_t>(byte & 0x7f) << shift;
+      shift += 7;
+      if (!(byte & 0x80)) {
+        break;
+      }
+    }
+    cells.insert(cells.end(), run, value);
+  }
+  return true;
+}
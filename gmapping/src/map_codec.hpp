@@ -0,0 +1,36 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+
+#ifndef MAP_CODEC_HPP_
+#define MAP_CODEC_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Run-length coding of OccupancyGrid cells as described in
+ * gmapping_msgs/CompressedOccupancyGrid ("rle"): a value byte followed by the
+ * run length as a LEB128 varint. Maps are mostly long runs of unknown and free
+ * cells, so they typically shrink by one to two orders of magnitude.
+ */
+// Replaces out with the encoding of count cells
+void encodeRunLength(const int8_t * cells, size_t count, std::vector<uint8_t> & out);
+// Replaces cells with the decoded data; false if data is malformed
+bool decodeRunLength(const std::vector<uint8_t> & data, std::vector<int8_t> & cells);
+
+#endif  // MAP_CODEC_HPP_
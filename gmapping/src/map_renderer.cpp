@@ -0,0 +1,149 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#include "map_renderer.hpp"
+
+#include <algorithm>
+
+namespace
+{
+
+using PatchGrid = GMapping::Array2D<GMapping::autoptr<GMapping::Array2D<GMapping::PointAccumulator>>>;
+
+// Fewer scans than this per worker are not worth a scratch map each
+const size_t kMinScansPerWorker = 16;
+
+}  // namespace
+
+MapRenderer::MapRenderer(unsigned int num_threads)
+: pool_(std::max(1u, num_threads))
+{
+  for (unsigned int i = 0; i < pool_.size(); ++i) {
+    matchers_.push_back(std::make_unique<GMapping::ScanMatcher>());
+  }
+}
+
+void MapRenderer::setLaserParameters(
+  std::vector<double> angles,
+  const GMapping::OrientedPoint & laser_pose, double max_range, double usable_range)
+{
+  for (auto & matcher : matchers_) {
+    matcher->setLaserParameters(angles.size(), angles.data(), laser_pose);
+    matcher->setlaserMaxRange(max_range);
+    matcher->setusableRange(usable_range);
+    matcher->setgenerateMap(true);
+  }
+}
+
+void MapRenderer::render(GMapping::ScanMatcherMap & map, const Scans & scans)
+{
+  const size_t workers = std::min<size_t>(pool_.size(), scans.size() / kMinScansPerWorker);
+  if (workers < 2) {
+    registerScans(*matchers_[0], map, scans, 0, scans.size());
+    return;
+  }
+
+  // Scratch maps start out with the target's extent and center, so their cells line
+  // up with the target's; they grow on their own like the target would
+  const GMapping::Point wmin = map.map2world(GMapping::IntPoint(0, 0));
+  const GMapping::Point wmax = map.map2world(GMapping::IntPoint(map.getMapSizeX(), map.getMapSizeY()));
+  tiles_.resize(workers);
+  const size_t chunk = (scans.size() + workers - 1) / workers;
+  pool_.parallelFor(workers,
+    [&](size_t i, unsigned int worker) {
+      tiles_[i] = std::make_unique<GMapping::ScanMatcherMap>(
+        map.getCenter(), wmin.x, wmin.y, wmax.x, wmax.y, map.getDelta());
+      registerScans(*matchers_[worker], *tiles_[i], scans, i * chunk,
+      std::min(scans.size(), (i + 1) * chunk));
+    });
+  reduce(map);
+  tiles_.clear();
+}
+
+void MapRenderer::registerScans(
+  GMapping::ScanMatcher & matcher,
+  GMapping::ScanMatcherMap & map, const Scans & scans, size_t begin, size_t end)
+{
+  for (size_t i = begin; i < end; ++i) {
+    const GMapping::OrientedPoint & pose = scans[i].first;
+    const GMapping::RangeReading * reading = scans[i].second;
+    if (!reading) {
+      continue;
+    }
+    matcher.invalidateActiveArea();
+    matcher.computeActiveArea(map, pose, &((*reading)[0]));
+    matcher.registerScan(map, pose, &((*reading)[0]));
+  }
+}
+
+void MapRenderer::reduce(GMapping::ScanMatcherMap & map)
+{
+  auto & storage = map.storage();
+  const int magnitude = storage.getPatchMagnitude();
+  const int patch_size = 1 << magnitude;
+
+  for (const auto & tile : tiles_) {
+    const GMapping::Point tmin = tile->map2world(GMapping::IntPoint(0, 0));
+    const GMapping::Point tmax =
+      tile->map2world(GMapping::IntPoint(tile->getMapSizeX(), tile->getMapSizeY()));
+    map.grow(tmin.x, tmin.y, tmax.x, tmax.y);
+  }
+
+  // The target patches under the tiles' allocated patches. Tile and target patches
+  // need not line up, so one tile patch can cover up to four target patches.
+  GMapping::HierarchicalArray2D<GMapping::PointAccumulator>::PointSet patches;
+  for (const auto & tile : tiles_) {
+    const auto & tile_storage = tile->storage();
+    for (int px = 0; px < tile_storage.getXSize(); ++px) {
+      for (int py = 0; py < tile_storage.getYSize(); ++py) {
+        if (!tile_storage.PatchGrid::cell(px, py)) {
+          continue;
+        }
+        const GMapping::IntPoint first(px << magnitude, py << magnitude);
+        const GMapping::IntPoint last(first.x + patch_size - 1, first.y + patch_size - 1);
+        const GMapping::IntPoint a = map.world2map(tile->map2world(first));
+        const GMapping::IntPoint b = map.world2map(tile->map2world(last));
+        for (int x = a.x >> magnitude; x <= b.x >> magnitude; ++x) {
+          for (int y = a.y >> magnitude; y <= b.y >> magnitude; ++y) {
+            patches.insert(GMapping::IntPoint(x, y));
+          }
+        }
+      }
+    }
+  }
+  // Like registerScan(), allocate and unshare the patches before writing to them
+  storage.setActiveArea(patches, true);
+  storage.allocActiveArea();
+
+  const std::vector<GMapping::IntPoint> targets(patches.begin(), patches.end());
+  pool_.parallelFor(targets.size(),
+    [&](size_t i, unsigned int) {
+      for (int x = 0; x < patch_size; ++x) {
+        for (int y = 0; y < patch_size; ++y) {
+          const GMapping::IntPoint c((targets[i].x << magnitude) + x,
+          (targets[i].y << magnitude) + y);
+          GMapping::PointAccumulator & cell = storage.cell(c);
+          const GMapping::Point world = map.map2world(c);
+          for (const auto & tile : tiles_) {
+            const GMapping::IntPoint tc = tile->world2map(world);
+            if (tile->isInside(tc) && tile->storage().isAllocated(tc)) {
+              cell.add(static_cast<const GMapping::ScanMatcherMap &>(*tile).cell(tc));
+            }
+          }
+        }
+      }
+    });
+}
@@ -0,0 +1,68 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+
+#ifndef MAP_RENDERER_HPP_
+#define MAP_RENDERER_HPP_
+
+/* OpenSLAM GMapping */
+#include <gmapping/scanmatcher/scanmatcher.h>
+#include <gmapping/sensor/sensor_range/rangereading.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+/*
+ * Registers trajectory scans into a ScanMatcherMap on several threads.
+ *
+ * Every worker ray casts a contiguous part of the trajectory into a scratch map
+ * aligned with the target, then the scratch maps are summed into the target patch
+ * by patch. Registering a scan only adds to the PointAccumulator of the cells it
+ * touches, so the result matches registering the scans one after the other.
+ */
+class MapRenderer
+{
+public:
+  using Scans = std::vector<std::pair<GMapping::OrientedPoint, const GMapping::RangeReading *>>;
+
+  explicit MapRenderer(unsigned int num_threads);
+
+  MapRenderer(const MapRenderer &) = delete;
+  MapRenderer & operator=(const MapRenderer &) = delete;
+
+  void setLaserParameters(
+    std::vector<double> angles, const GMapping::OrientedPoint & laser_pose,
+    double max_range, double usable_range);
+
+  // Registers scans into map; scans without a reading are skipped
+  void render(GMapping::ScanMatcherMap & map, const Scans & scans);
+
+private:
+  void registerScans(
+    GMapping::ScanMatcher & matcher, GMapping::ScanMatcherMap & map, const Scans & scans,
+    size_t begin, size_t end);
+  void reduce(GMapping::ScanMatcherMap & map);
+
+  ThreadPool pool_;
+  // One matcher per pool worker; registering a scan changes the matcher's active area
+  std::vector<std::unique_ptr<GMapping::ScanMatcher>> matchers_;
+  std::vector<std::unique_ptr<GMapping::ScanMatcherMap>> tiles_;
+};
+
+#endif  // MAP_RENDERER_HPP_
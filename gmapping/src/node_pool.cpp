@@ -0,0 +1,163 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#include "node_pool.hpp"
+
+#include <cassert>
+#include <mutex>
+#include <new>
+
+namespace
+{
+
+struct PooledReading : public GMapping::RangeReading
+{
+  explicit PooledReading(const GMapping::RangeReading & reading)
+  : GMapping::RangeReading(reading)
+  {
+  }
+
+  // Refills the reading in place; the beams keep their capacity
+  void assign(const GMapping::RangeReading & reading)
+  {
+    std::vector<double>::assign(reading.begin(), reading.end());
+    m_time = reading.getTime();
+    m_sensor = reading.getSensor();
+    m_pose = reading.getPose();
+  }
+
+  // Nodes the reading is attached to
+  unsigned int nodes = 0;
+};
+
+PooledReading * pooled(const GMapping::RangeReading * reading)
+{
+  // Every reading in the tree comes from copyReading()
+  return static_cast<PooledReading *>(const_cast<GMapping::RangeReading *>(reading));
+}
+
+}  // namespace
+
+// Taken out readings come back from the map builder's thread, hence the lock
+struct NodePool::ReadingStore
+{
+  std::mutex mutex;
+  std::vector<std::unique_ptr<PooledReading>> readings;
+  std::vector<PooledReading *> retired;
+  std::vector<PooledReading *> free;
+};
+
+void NodePool::ReadingDeleter::operator()(const GMapping::RangeReading * reading) const
+{
+  std::lock_guard<std::mutex> lock(store->mutex);
+  store->free.push_back(pooled(reading));
+}
+
+NodePool::NodePool(size_t block_size)
+: block_size_(block_size), readings_(std::make_shared<ReadingStore>())
+{
+}
+
+GMapping::GridSlamProcessor::TNode * NodePool::create(
+  const GMapping::OrientedPoint & pose,
+  TNode * parent)
+{
+  if (free_.empty()) {
+    blocks_.emplace_back(new Slot[block_size_]);
+    Slot * block = blocks_.back().get();
+    for (size_t i = block_size_; i > 0; --i) {
+      free_.push_back(&block[i - 1]);
+    }
+  }
+  void * slot = free_.back();
+  free_.pop_back();
+  size_++;
+  return new (slot) TNode(pose, 0.0, parent, 0);
+}
+
+void NodePool::release(TNode * node)
+{
+  while (node) {
+    TNode * parent = node->parent;
+    node->parent = nullptr;
+    destroy(node);
+    if (!parent || --parent->childs > 0) {
+      return;
+    }
+    node = parent;
+  }
+}
+
+void NodePool::destroy(TNode * node)
+{
+  if (node->reading && --pooled(node->reading)->nodes == 0) {
+    std::lock_guard<std::mutex> lock(readings_->mutex);
+    readings_->retired.push_back(pooled(node->reading));
+  }
+  node->~TNode();
+  free_.push_back(node);
+  size_--;
+}
+
+size_t NodePool::size() const
+{
+  return size_;
+}
+
+const GMapping::RangeReading * NodePool::copyReading(const GMapping::RangeReading & reading)
+{
+  std::lock_guard<std::mutex> lock(readings_->mutex);
+  if (readings_->free.empty()) {
+    readings_->readings.push_back(std::make_unique<PooledReading>(reading));
+    return readings_->readings.back().get();
+  }
+  PooledReading * copy = readings_->free.back();
+  readings_->free.pop_back();
+  copy->assign(reading);
+  return copy;
+}
+
+void NodePool::attachReading(TNode * node, const GMapping::RangeReading * reading)
+{
+  node->reading = reading;
+  pooled(reading)->nodes++;
+}
+
+NodePool::ReadingPtr NodePool::takeReading(TNode * node)
+{
+  if (!node->reading) {
+    return ReadingPtr(nullptr, ReadingDeleter{readings_});
+  }
+  PooledReading * reading = pooled(node->reading);
+  node->reading = nullptr;
+  assert(reading->nodes == 1);
+  reading->nodes = 0;
+  return ReadingPtr(reading, ReadingDeleter{readings_});
+}
+
+void NodePool::recycleReadings()
+{
+  std::lock_guard<std::mutex> lock(readings_->mutex);
+  readings_->free.insert(readings_->free.end(),
+    readings_->retired.begin(), readings_->retired.end());
+  readings_->retired.clear();
+}
+
+size_t NodePool::readingCount() const
+{
+  std::lock_guard<std::mutex> lock(readings_->mutex);
+  return readings_->readings.size();
+}
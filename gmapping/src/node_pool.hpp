@@ -0,0 +1,93 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+
+#ifndef NODE_POOL_HPP_
+#define NODE_POOL_HPP_
+
+/* OpenSLAM GMapping */
+#include <gmapping/gridfastslam/gridslamprocessor.h>
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Allocates trajectory tree nodes from blocks that are kept for reuse, so a long
+ * run does not hit the heap twice per particle and scan.
+ *
+ * Nodes from the pool must be released here and never deleted: ~TNode() deletes
+ * a parent left without children, so release() detaches the parent first and
+ * walks up the tree itself.
+ *
+ * The readings of the nodes come from the pool as well. A reading is shared by
+ * the nodes of one generation and retired with the last of them; retired
+ * readings are only reused after recycleReadings(), so the caller can hold on to
+ * raw reading pointers until it knows nothing refers to them any more.
+ */
+class NodePool
+{
+  struct ReadingStore;
+
+public:
+  using TNode = GMapping::GridSlamProcessor::TNode;
+
+  // Hands a reading taken out of the tree back to the pool, which it keeps alive
+  struct ReadingDeleter
+  {
+    std::shared_ptr<ReadingStore> store;
+    void operator()(const GMapping::RangeReading * reading) const;
+  };
+  using ReadingPtr = std::unique_ptr<const GMapping::RangeReading, ReadingDeleter>;
+
+  explicit NodePool(size_t block_size = 1024);
+
+  NodePool(const NodePool &) = delete;
+  NodePool & operator=(const NodePool &) = delete;
+
+  // A node with no reading, linked below parent like new TNode(pose, 0, parent)
+  TNode * create(const GMapping::OrientedPoint & pose, TNode * parent);
+  // Destroys node and, as ~TNode() would, every ancestor left without children
+  void release(TNode * node);
+  // Destroys node alone; the caller has unlinked it from the tree
+  void destroy(TNode * node);
+
+  // Copy of reading for the nodes of one generation; attach it to at least one node
+  const GMapping::RangeReading * copyReading(const GMapping::RangeReading & reading);
+  // Sets node->reading to a reading from copyReading()
+  void attachReading(TNode * node, const GMapping::RangeReading * reading);
+  // Takes the reading out of node, the only node it is attached to
+  ReadingPtr takeReading(TNode * node);
+  // Lets copyReading() reuse the readings retired so far
+  void recycleReadings();
+  // Readings allocated so far, whether in the tree, taken out, retired or free
+  size_t readingCount() const;
+
+  // Nodes handed out and not released yet
+  size_t size() const;
+
+private:
+  using Slot = std::aligned_storage<sizeof(TNode), alignof(TNode)>::type;
+
+  size_t block_size_;
+  std::vector<std::unique_ptr<Slot[]>> blocks_;
+  std::vector<void *> free_;
+  size_t size_ = 0;
+  std::shared_ptr<ReadingStore> readings_;
+};
+
+#endif  // NODE_POOL_HPP_
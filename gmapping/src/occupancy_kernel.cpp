@@ -0,0 +1,126 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#include "occupancy_kernel.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+void thresholdOccupancyScalar(
+  const double * occupancy, size_t count, double occ_thresh,
+  int8_t * out)
+{
+  for (size_t i = 0; i < count; ++i) {
+    /// @todo Sort out the unknown vs. free vs. obstacle thresholding
+    const double occ = occupancy[i];
+    if (occ < 0) {
+      out[i] = -1;
+    } else if (occ > occ_thresh) {
+      out[i] = 100;
+    } else {
+      out[i] = 0;
+    }
+  }
+}
+
+void thresholdOccupancy(const double * occupancy, size_t count, double occ_thresh, int8_t * out)
+{
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d thresh = _mm_set1_pd(occ_thresh);
+  const __m128i occupied = _mm_set1_epi32(100);
+  // Eight cells per iteration: each compare gives two 64 bit lane masks, which are
+  // narrowed to 32, 16 and finally 8 bits with saturating packs (-1 and 100 survive).
+  for (; i + 8 <= count; i += 8) {
+    __m128i lanes[4];
+    for (int k = 0; k < 4; ++k) {
+      const __m128d v = _mm_loadu_pd(occupancy + i + 2 * k);
+      const __m128i unknown = _mm_castpd_si128(_mm_cmplt_pd(v, zero));
+      const __m128i full = _mm_castpd_si128(_mm_cmpgt_pd(v, thresh));
+      lanes[k] = _mm_or_si128(unknown, _mm_and_si128(_mm_andnot_si128(unknown, full), occupied));
+    }
+    const __m128i lo = _mm_unpacklo_epi64(
+      _mm_shuffle_epi32(lanes[0], _MM_SHUFFLE(2, 0, 2, 0)),
+      _mm_shuffle_epi32(lanes[1], _MM_SHUFFLE(2, 0, 2, 0)));
+    const __m128i hi = _mm_unpacklo_epi64(
+      _mm_shuffle_epi32(lanes[2], _MM_SHUFFLE(2, 0, 2, 0)),
+      _mm_shuffle_epi32(lanes[3], _MM_SHUFFLE(2, 0, 2, 0)));
+    const __m128i words = _mm_packs_epi32(lo, hi);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out + i), _mm_packs_epi16(words, words));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const float64x2_t zero = vdupq_n_f64(0.0);
+  const float64x2_t thresh = vdupq_n_f64(occ_thresh);
+  const uint64x2_t occupied = vdupq_n_u64(100);
+  // Eight cells per iteration, narrowed from 64 bit lane masks down to bytes
+  for (; i + 8 <= count; i += 8) {
+    uint32x2_t lanes[4];
+    for (int k = 0; k < 4; ++k) {
+      const float64x2_t v = vld1q_f64(occupancy + i + 2 * k);
+      const uint64x2_t unknown = vcltq_f64(v, zero);
+      const uint64x2_t full = vcgtq_f64(v, thresh);
+      lanes[k] = vmovn_u64(vorrq_u64(unknown, vandq_u64(vbicq_u64(full, unknown), occupied)));
+    }
+    const uint16x4_t lo = vmovn_u32(vcombine_u32(lanes[0], lanes[1]));
+    const uint16x4_t hi = vmovn_u32(vcombine_u32(lanes[2], lanes[3]));
+    vst1_s8(out + i, vreinterpret_s8_u8(vmovn_u16(vcombine_u16(lo, hi))));
+  }
+#endif
+  thresholdOccupancyScalar(occupancy + i, count - i, occ_thresh, out + i);
+}
+
+void downsampleOccupancyScalar(const int8_t * row, size_t width, int8_t * out)
+{
+  for (size_t x = 0; x < width; ++x) {
+    if (row[x] > out[x / 2]) {
+      out[x / 2] = row[x];
+    }
+  }
+}
+
+void downsampleOccupancy(const int8_t * row, size_t width, int8_t * out)
+{
+  size_t x = 0;
+#if defined(__SSE2__)
+  // SSE2 only has an unsigned byte max, so flip the sign bit to keep the order
+  const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80));
+  const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+  // 32 source cells per iteration: max of each pair in the low byte of a 16 bit
+  // lane, packed back to 16 bytes
+  for (; x + 32 <= width; x += 32) {
+    const __m128i a = _mm_xor_si128(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x)), bias);
+    const __m128i b = _mm_xor_si128(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x + 16)), bias);
+    const __m128i pairs_a = _mm_and_si128(_mm_max_epu8(a, _mm_srli_epi16(a, 8)), low_bytes);
+    const __m128i pairs_b = _mm_and_si128(_mm_max_epu8(b, _mm_srli_epi16(b, 8)), low_bytes);
+    __m128i * dst = reinterpret_cast<__m128i *>(out + x / 2);
+    const __m128i current = _mm_xor_si128(_mm_loadu_si128(dst), bias);
+    _mm_storeu_si128(dst,
+      _mm_xor_si128(_mm_max_epu8(current, _mm_packus_epi16(pairs_a, pairs_b)), bias));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; x + 32 <= width; x += 32) {
+    const int8x16_t pairs = vpmaxq_s8(vld1q_s8(row + x), vld1q_s8(row + x + 16));
+    vst1q_s8(out + x / 2, vmaxq_s8(vld1q_s8(out + x / 2), pairs));
+  }
+#endif
+  downsampleOccupancyScalar(row + x, width - x, out + x / 2);
+}
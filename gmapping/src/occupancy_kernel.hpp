@@ -0,0 +1,42 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#ifndef OCCUPANCY_KERNEL_HPP_
+#define OCCUPANCY_KERNEL_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Convert a run of GMapping occupancy values (negative for unknown) into
+ * nav_msgs/OccupancyGrid cells: -1 for unknown, 100 above occ_thresh, 0 otherwise.
+ * Uses SSE2 or NEON when available; the scalar version gives the same output.
+ */
+void thresholdOccupancy(const double * occupancy, size_t count, double occ_thresh, int8_t * out);
+void thresholdOccupancyScalar(
+  const double * occupancy, size_t count, double occ_thresh,
+  int8_t * out);
+
+/*
+ * Fold one row of OccupancyGrid cells into the row of a grid at half the
+ * resolution: out[i] becomes the largest of out[i], row[2 i] and row[2 i + 1], so an
+ * occupied cell wins over a free one and a free one over unknown. out holds
+ * (width + 1) / 2 cells; start it at -1 and fold both source rows into it.
+ */
+void downsampleOccupancy(const int8_t * row, size_t width, int8_t * out);
+void downsampleOccupancyScalar(const int8_t * row, size_t width, int8_t * out);
+
+#endif  // OCCUPANCY_KERNEL_HPP_
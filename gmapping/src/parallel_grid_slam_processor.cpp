@@ -0,0 +1,872 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+/*
+ * The update step follows GridSlamProcessor::processScan() and the helpers in
+ * gridslamprocessor.hxx / gfstree.cpp of OpenSLAM GMapping.
+ */
+
+#include "parallel_grid_slam_processor.hpp"
+
+#include <gmapping/utils/point.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+
+using Patch = GMapping::Array2D<GMapping::PointAccumulator>;
+using PatchPtr = GMapping::autoptr<Patch>;
+using PatchGrid = GMapping::Array2D<PatchPtr>;
+
+// Visit count given to restored cells, so n / visits keeps the quantized occupancy
+const int kCompactVisits = 126;
+
+// The slot of the patch holding the cell at world, or nullptr outside the map
+PatchPtr * patchAt(GMapping::ScanMatcherMap & map, const GMapping::Point & world)
+{
+  GMapping::IntPoint c = map.world2map(world);
+  if (!map.isInside(c)) {
+    return nullptr;
+  }
+  const int magnitude = map.storage().getPatchMagnitude();
+  return &map.storage().PatchGrid::cell(c.x >> magnitude, c.y >> magnitude);
+}
+
+/*
+ * 16 bit cell: 0 for a cell never seen, otherwise the occupancy n / visits in 7
+ * bits (1..127) and, for cells with hits, the mean hit point relative to the cell
+ * center in 4 bits per axis.
+ */
+uint16_t encodeCell(
+  const GMapping::PointAccumulator & cell, const GMapping::Point & center,
+  double delta)
+{
+  if (cell.visits <= 0) {
+    return 0;
+  }
+  const int occupancy = 1 + static_cast<int>(
+    std::lround(static_cast<double>(cell.n) / cell.visits * (kCompactVisits - 1)));
+  int dx = 8;
+  int dy = 8;
+  if (cell.n > 0) {
+    const GMapping::Point mean = cell.mean();
+    dx = std::max(0, std::min(15, static_cast<int>(std::lround((mean.x - center.x) / delta * 15 + 7.5))));
+    dy = std::max(0, std::min(15, static_cast<int>(std::lround((mean.y - center.y) / delta * 15 + 7.5))));
+  }
+  return static_cast<uint16_t>((std::min(occupancy, 127) << 8) | (dx << 4) | dy);
+}
+
+GMapping::PointAccumulator decodeCell(
+  uint16_t code, const GMapping::Point & center,
+  double delta)
+{
+  GMapping::PointAccumulator cell;
+  if (!code) {
+    return cell;
+  }
+  cell.visits = kCompactVisits;
+  cell.n = (code >> 8) - 1;
+  const double mean_x = center.x + (((code >> 4) & 15) - 7.5) / 15 * delta;
+  const double mean_y = center.y + ((code & 15) - 7.5) / 15 * delta;
+  cell.acc.x = static_cast<float>(mean_x * cell.n);
+  cell.acc.y = static_cast<float>(mean_y * cell.n);
+  return cell;
+}
+
+double propagateWeight(GMapping::GridSlamProcessor::TNode * n, double weight)
+{
+  if (!n) {
+    return weight;
+  }
+  double w = 0;
+  n->visitCounter++;
+  n->accWeight += weight;
+  if (n->visitCounter == n->childs) {
+    w = propagateWeight(n->parent, n->accWeight);
+  }
+  assert(n->visitCounter <= n->childs);
+  return w;
+}
+
+}  // namespace
+
+ParallelGridSlamProcessor::ParallelGridSlamProcessor(std::ostream & infoStr)
+: GMapping::GridSlamProcessor(infoStr)
+{
+  setThreadCount(1);
+}
+
+void ParallelGridSlamProcessor::setSeed(uint64_t seed)
+{
+  rng_ = Philox(seed);
+}
+
+bool ParallelGridSlamProcessor::setMatcherBackend(MatcherBackend backend)
+{
+  device_scorer_.reset();
+  if (backend == MatcherBackend::kCpu) {
+    return true;
+  }
+#ifdef GMAPPING_CUDA
+  device_scorer_ = CudaScanScorer::create();
+  if (device_scorer_) {
+    device_scorer_->configure(beam_matcher_);
+  }
+#endif
+  return device_scorer_ != nullptr;
+}
+
+ParallelGridSlamProcessor::MatcherBackend ParallelGridSlamProcessor::matcherBackend() const
+{
+  return device_scorer_ ? MatcherBackend::kCuda : MatcherBackend::kCpu;
+}
+
+void ParallelGridSlamProcessor::setAdaptiveParticles(
+  bool enabled, unsigned int min_particles,
+  unsigned int max_particles)
+{
+  adaptive_particles_ = enabled;
+  min_particles_ = std::max(1u, min_particles);
+  max_particles_ = std::max(min_particles_, max_particles);
+}
+
+void ParallelGridSlamProcessor::setKldParameters(
+  double err, double z, double xy_bin_size,
+  double theta_bin_size)
+{
+  kld_err_ = err;
+  kld_z_ = z;
+  kld_xy_bin_size_ = xy_bin_size;
+  kld_theta_bin_size_ = theta_bin_size;
+}
+
+ParallelGridSlamProcessor::~ParallelGridSlamProcessor()
+{
+  // Release the tree here, GridSlamProcessor would delete pool nodes.
+  // Before the first scan all particles share the root.
+  std::vector<TNode *> leaves;
+  for (auto & particle : m_particles) {
+    if (particle.node) {
+      leaves.push_back(particle.node);
+      particle.node = nullptr;
+    }
+  }
+  std::sort(leaves.begin(), leaves.end());
+  leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+  for (TNode * leaf : leaves) {
+    node_pool_.release(leaf);
+  }
+}
+
+void ParallelGridSlamProcessor::init(
+  unsigned int size, double xmin, double ymin, double xmax,
+  double ymax, double delta, GMapping::OrientedPoint initialPose)
+{
+  GridSlamProcessor::init(size, xmin, ymin, xmax, ymax, delta, initialPose);
+  // the library allocates the shared root with new, move it into the pool
+  TNode * root = m_particles.empty() ? nullptr : m_particles.front().node;
+  if (root) {
+    TNode * pooled = node_pool_.create(root->pose, nullptr);
+    delete root;
+    for (auto & particle : m_particles) {
+      particle.node = pooled;
+    }
+  }
+#ifdef GMAPPING_CUDA
+  if (device_scorer_) {
+    device_scorer_->clear();
+  }
+#endif
+}
+
+void ParallelGridSlamProcessor::resume(
+  const GMapping::ScanMatcherMap & map,
+  const GMapping::OrientedPoint & odom_pose)
+{
+  // Copies share the map's patches until a particle writes to them. As after the first
+  // scan, every particle gets a node of its own below the root, since resample() releases
+  // the nodes of the particles it drops.
+  for (auto & particle : m_particles) {
+    particle.map = map;
+    particle.node = node_pool_.create(particle.pose, particle.node);
+  }
+#ifdef GMAPPING_CUDA
+  if (device_scorer_) {
+    device_scorer_->clear();
+  }
+#endif
+  // With a scan counted the next one is matched against the map instead of
+  // only registered, and the motion since odom_pose is applied first
+  m_lastPartPose = m_odoPose = odom_pose;
+  m_count = 1;
+}
+
+size_t ParallelGridSlamProcessor::pruneTree(std::vector<PrunedScan> & scans)
+{
+  if (m_particles.empty()) {
+    return 0;
+  }
+  // Count the particles below every node; the first node on a particle's path
+  // that all of them pass through is the newest common ancestor
+  for (auto & particle : m_particles) {
+    for (TNode * n = particle.node; n; n = n->parent) {
+      n->visitCounter = 0;
+    }
+  }
+  for (auto & particle : m_particles) {
+    for (TNode * n = particle.node; n; n = n->parent) {
+      n->visitCounter++;
+    }
+  }
+  TNode * ancestor = m_particles.front().node;
+  while (ancestor && ancestor->visitCounter < m_particles.size()) {
+    ancestor = ancestor->parent;
+  }
+  if (!ancestor || !ancestor->parent) {
+    return 0;
+  }
+
+  // Above the common ancestor the tree is a single chain with one node per
+  // generation, so nothing else refers to these readings
+  const size_t first = scans.size();
+  TNode * n = ancestor->parent;
+  ancestor->parent = nullptr;
+  while (n) {
+    TNode * parent = n->parent;
+    scans.push_back({n->pose, node_pool_.takeReading(n)});
+    n->childs = 0;
+    n->parent = nullptr;
+    node_pool_.destroy(n);
+    n = parent;
+  }
+  std::reverse(scans.begin() + first, scans.end());
+  return scans.size() - first;
+}
+
+size_t ParallelGridSlamProcessor::trajectoryNodeCount() const
+{
+  return node_pool_.size();
+}
+
+void ParallelGridSlamProcessor::recycleReadings()
+{
+  node_pool_.recycleReadings();
+}
+
+size_t ParallelGridSlamProcessor::readingCount() const
+{
+  return node_pool_.readingCount();
+}
+
+void ParallelGridSlamProcessor::setThreadCount(unsigned int num_threads)
+{
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  pool_ = std::make_unique<ThreadPool>(num_threads);
+  matchers_.clear();
+  for (unsigned int i = 0; i < num_threads; ++i) {
+    matchers_.push_back(std::make_unique<GMapping::ScanMatcher>());
+  }
+}
+
+void ParallelGridSlamProcessor::configureMatchers(const GMapping::RangeSensor & sensor)
+{
+  std::vector<double> angles(sensor.beams().size());
+  for (unsigned int i = 0; i < angles.size(); ++i) {
+    angles[i] = sensor.beams()[i].pose.theta;
+  }
+
+  for (auto & matcher : matchers_) {
+    matcher->setLaserParameters(angles.size(), angles.data(), sensor.getPose());
+    matcher->setMatchingParameters(
+      m_matcher.getusableRange(), m_matcher.getlaserMaxRange(), m_matcher.getgaussianSigma(),
+      m_matcher.getkernelSize(), m_matcher.getoptLinearDelta(), m_matcher.getoptAngularDelta(),
+      m_matcher.getoptRecursiveIterations(), m_matcher.getlikelihoodSigma(),
+      m_matcher.getlikelihoodSkip());
+    matcher->setllsamplerange(m_matcher.getllsamplerange());
+    matcher->setllsamplestep(m_matcher.getllsamplestep());
+    matcher->setlasamplerange(m_matcher.getlasamplerange());
+    matcher->setlasamplestep(m_matcher.getlasamplestep());
+    matcher->setgenerateMap(m_matcher.getgenerateMap());
+    matcher->setenlargeStep(m_matcher.getenlargeStep());
+    matcher->setfullnessThreshold(m_matcher.getfullnessThreshold());
+    matcher->setangularOdometryReliability(m_matcher.getangularOdometryReliability());
+    matcher->setlinearOdometryReliability(m_matcher.getlinearOdometryReliability());
+    matcher->setfreeCellRatio(m_matcher.getfreeCellRatio());
+    matcher->setinitialBeamsSkip(m_matcher.getinitialBeamsSkip());
+  }
+  beam_matcher_.configure(*matchers_.front());
+#ifdef GMAPPING_CUDA
+  if (device_scorer_) {
+    device_scorer_->configure(beam_matcher_);
+  }
+#endif
+}
+
+bool ParallelGridSlamProcessor::processScan(
+  const GMapping::RangeReading & reading,
+  int adaptParticles)
+{
+  GMapping::OrientedPoint relPose = reading.getPose();
+  if (!m_count) {
+    m_lastPartPose = m_odoPose = relPose;
+  }
+
+  // update all the particles using the motion model; every particle draws from its own
+  // stream, so the order the workers take them in does not matter
+  pool_->parallelFor(m_particles.size(),
+    [this, &relPose](size_t i, unsigned int) {
+      Particle & particle = m_particles[i];
+      particle.pose = drawFromMotion(particle.pose, relPose, m_odoPose, i);
+    });
+  onOdometryUpdate();
+
+  // accumulate the robot translation and rotation
+  GMapping::OrientedPoint move = relPose - m_odoPose;
+  move.theta = atan2(sin(move.theta), cos(move.theta));
+  m_linearDistance += sqrt(move * move);
+  m_angularDistance += fabs(move.theta);
+  m_odoPose = relPose;
+
+  bool processed = false;
+
+  // process a scan only if the robot has traveled a given distance or a certain amount of time
+  // has elapsed
+  if (!m_count ||
+    m_linearDistance >= m_linearThresholdDistance ||
+    m_angularDistance >= m_angularThresholdDistance ||
+    (period_ >= 0.0 && (reading.getTime() - last_update_time_) > period_))
+  {
+    last_update_time_ = reading.getTime();
+
+    assert(reading.size() == m_beams);
+    plain_reading_.assign(reading.begin(), reading.end());
+    const double * plain_reading = plain_reading_.data();
+
+    // The trajectory tree keeps its own copy of the reading, from the node pool
+    const GMapping::RangeReading * reading_copy = node_pool_.copyReading(reading);
+
+    restoreNearbyPatches();
+
+    if (m_count > 0) {
+      scanMatch(plain_reading);
+      onScanmatchUpdate();
+      updateTreeWeights(false);
+      resample(plain_reading, adaptParticles, reading_copy);
+    } else {
+      for (auto & particle : m_particles) {
+        registerScan(particle, plain_reading);
+        // particles refer to the root in the beginning
+        TNode * node = node_pool_.create(particle.pose, particle.node);
+        node_pool_.attachReading(node, reading_copy);
+        particle.node = node;
+      }
+    }
+    updateTreeWeights(false);
+
+    m_lastPartPose = m_odoPose;
+    m_linearDistance = 0;
+    m_angularDistance = 0;
+    m_count++;
+    processed = true;
+
+    // keep ready for the next step
+    for (auto & particle : m_particles) {
+      particle.previousPose = particle.pose;
+    }
+  }
+  m_readingCount++;
+  return processed;
+}
+
+void ParallelGridSlamProcessor::scanMatch(const double * plain_reading)
+{
+  // optimize() and likelihoodAndScore() only read the particle's map, so they are safe to run
+  // concurrently. Computing the active area may grow the map, which touches patches shared
+  // between particles, so it stays on this thread.
+  const bool on_device = device_scorer_ != nullptr;
+#ifdef GMAPPING_CUDA
+  if (on_device) {
+    device_search_.init.clear();
+    device_maps_.clear();
+    for (const auto & particle : m_particles) {
+      device_search_.init.push_back(particle.pose);
+      device_maps_.push_back(&particle.map);
+    }
+    device_scorer_->prepare(device_maps_, device_search_.init, plain_reading);
+    CudaScanScorer & scorer = *device_scorer_;
+    beam_matcher_.optimizeBatch(device_search_,
+      [&scorer](const std::vector<BeamScanMatcher::Candidate> & candidates,
+      std::vector<double> & scores) {
+        scorer.score(candidates, scores);
+      });
+  }
+#endif
+  pool_->parallelFor(m_particles.size(),
+    [this, plain_reading, on_device](size_t i, unsigned int worker) {
+      GMapping::ScanMatcher & matcher = *matchers_[worker];
+      Particle & particle = m_particles[i];
+
+      GMapping::OrientedPoint corrected;
+      double score;
+      if (on_device) {
+        corrected = device_search_.pose[i];
+        score = device_search_.score[i];
+      } else {
+        score = beam_matcher_.optimize(corrected, particle.map, particle.pose, plain_reading);
+      }
+      if (score > m_minimumScore) {
+        particle.pose = corrected;
+      }
+
+      double s, l;
+      matcher.likelihoodAndScore(s, l, particle.map, particle.pose, plain_reading);
+      particle.weight += l;
+      particle.weightSum += l;
+    });
+
+  // set up the selective copy of the active area by detaching the areas that will be updated
+  for (auto & particle : m_particles) {
+    m_matcher.invalidateActiveArea();
+    m_matcher.computeActiveArea(particle.map, particle.pose, plain_reading);
+  }
+  restoreActivePatches();
+}
+
+void ParallelGridSlamProcessor::registerScan(Particle & particle, const double * plain_reading)
+{
+  m_matcher.invalidateActiveArea();
+  m_matcher.registerScan(particle.map, particle.pose, plain_reading);
+#ifdef GMAPPING_CUDA
+  if (device_scorer_) {
+    // the registration wrote to the patches of the active area, which may also have been
+    // allocated at the address of a patch freed since
+    const auto & storage = particle.map.storage();
+    for (const auto & index : storage.getActiveArea()) {
+      const PatchPtr & patch = storage.PatchGrid::cell(index.x, index.y);
+      if (patch) {
+        device_scorer_->invalidate(&*patch);
+      }
+    }
+  }
+#endif
+}
+
+void ParallelGridSlamProcessor::normalize()
+{
+  // normalize the log weights
+  double gain = 1. / (m_obsSigmaGain * m_particles.size());
+  double lmax = -std::numeric_limits<double>::max();
+  for (const auto & particle : m_particles) {
+    lmax = particle.weight > lmax ? particle.weight : lmax;
+  }
+
+  m_weights.clear();
+  double wcum = 0;
+  for (const auto & particle : m_particles) {
+    m_weights.push_back(exp(gain * (particle.weight - lmax)));
+    wcum += m_weights.back();
+  }
+
+  m_neff = 0;
+  for (auto & w : m_weights) {
+    w = w / wcum;
+    m_neff += w * w;
+  }
+  m_neff = 1. / m_neff;
+}
+
+bool ParallelGridSlamProcessor::resample(
+  const double * plain_reading, int adapt_size,
+  const GMapping::RangeReading * reading)
+{
+  bool has_resampled = false;
+
+  old_generation_.clear();
+  for (const auto & particle : m_particles) {
+    old_generation_.push_back(particle.node);
+  }
+
+  if (m_neff < m_resampleThreshold * m_particles.size()) {
+    if (adapt_size <= 0 && adaptive_particles_) {
+      adapt_size = kldSampleCount();
+    }
+    resampleIndexes(adapt_size, kResampleStream);
+    onResampleUpdate();
+
+    // build the new generation of the tree
+    ParticleVector & temp = next_generation_;
+    temp.clear();
+    unsigned int j = 0;
+    // particles which have been resampled away
+    std::vector<unsigned int> & deleted_particles = deleted_particles_;
+    deleted_particles.clear();
+    for (unsigned int i = 0; i < m_indexes.size(); i++) {
+      while (j < m_indexes[i]) {
+        deleted_particles.push_back(j);
+        j++;
+      }
+      if (j == m_indexes[i]) {
+        j++;
+      }
+      Particle & p = m_particles[m_indexes[i]];
+      TNode * node = node_pool_.create(p.pose, old_generation_[m_indexes[i]]);
+      node_pool_.attachReading(node, reading);
+      temp.push_back(p);
+      temp.back().node = node;
+      temp.back().previousIndex = m_indexes[i];
+    }
+    // the new generation may be smaller than the old one when adapting the particle count
+    while (j < m_particles.size()) {
+      deleted_particles.push_back(j);
+      j++;
+    }
+    for (auto index : deleted_particles) {
+      node_pool_.release(m_particles[index].node);
+      m_particles[index].node = nullptr;
+    }
+
+    m_particles.clear();
+    for (auto & particle : temp) {
+      particle.setWeight(0);
+      registerScan(particle, plain_reading);
+      m_particles.push_back(particle);
+    }
+    // drop the maps held by the copies
+    temp.clear();
+    normalize();
+    has_resampled = true;
+  } else {
+    int index = 0;
+    auto node_it = old_generation_.begin();
+    for (auto & particle : m_particles) {
+      // create a new node in the particle tree and add it to the old tree
+      TNode * node = node_pool_.create(particle.pose, *node_it);
+      node_pool_.attachReading(node, reading);
+      particle.node = node;
+      registerScan(particle, plain_reading);
+      particle.previousIndex = index;
+      index++;
+      node_it++;
+    }
+  }
+  return has_resampled;
+}
+
+void ParallelGridSlamProcessor::resampleIndexes(int adapt_size, RandomStream stream)
+{
+  // low variance sampling as in uniform_resampler::resampleIndexes()
+  double cweight = 0;
+  for (double w : m_weights) {
+    cweight += w;
+  }
+  unsigned int n = adapt_size > 0 ? adapt_size : m_weights.size();
+  double interval = cweight / n;
+  double target = interval * rng_.uniform(randomCounter(stream, 0, 0))[0];
+
+  m_indexes.assign(n, 0);
+  cweight = 0;
+  n = 0;
+  for (unsigned int i = 0; i < m_weights.size(); i++) {
+    cweight += m_weights[i];
+    while (cweight > target && n < m_indexes.size()) {
+      m_indexes[n++] = i;
+      target += interval;
+    }
+  }
+}
+
+unsigned int ParallelGridSlamProcessor::kldSampleCount()
+{
+  // KLD sampling (Fox, 2003): count the pose histogram bins a draw of max_particles_
+  // samples occupies and keep enough particles to bound the KL divergence of the
+  // sampled distribution to kld_err_ with the confidence given by kld_z_
+  resampleIndexes(max_particles_, kKldStream);
+  kld_bins_.clear();
+  for (unsigned int index : m_indexes) {
+    const GMapping::OrientedPoint & pose = m_particles[index].pose;
+    kld_bins_.push_back({{
+        static_cast<int>(std::floor(pose.x / kld_xy_bin_size_)),
+        static_cast<int>(std::floor(pose.y / kld_xy_bin_size_)),
+        static_cast<int>(std::floor(pose.theta / kld_theta_bin_size_))}});
+  }
+  std::sort(kld_bins_.begin(), kld_bins_.end());
+  const size_t k = std::unique(kld_bins_.begin(), kld_bins_.end()) - kld_bins_.begin();
+
+  if (k <= 1) {
+    return min_particles_;
+  }
+  const double a = 2.0 / (9.0 * (k - 1));
+  const double b = 1.0 - a + std::sqrt(a) * kld_z_;
+  const double n = std::ceil((k - 1) / (2.0 * kld_err_) * b * b * b);
+  return static_cast<unsigned int>(
+    std::max<double>(min_particles_, std::min<double>(max_particles_, n)));
+}
+
+size_t ParallelGridSlamProcessor::mapMemoryUsage() const
+{
+  std::vector<const Patch *> patches;
+  size_t patch_size = 0;
+  for (const auto & particle : m_particles) {
+    const auto & storage = particle.map.storage();
+    patch_size = size_t(1) << storage.getPatchMagnitude();
+    for (int x = 0; x < storage.getXSize(); ++x) {
+      for (int y = 0; y < storage.getYSize(); ++y) {
+        const PatchPtr & patch = storage.PatchGrid::cell(x, y);
+        if (patch) {
+          patches.push_back(&*patch);
+        }
+      }
+    }
+  }
+  std::sort(patches.begin(), patches.end());
+  const size_t unique = std::unique(patches.begin(), patches.end()) - patches.begin();
+  return unique * (sizeof(Patch) + patch_size * patch_size * sizeof(GMapping::PointAccumulator)) +
+         compact_patches_.size() * (sizeof(CompactPatch) + patch_size * patch_size * sizeof(uint16_t));
+}
+
+size_t ParallelGridSlamProcessor::compactDistantPatches(double distance)
+{
+  if (m_particles.empty()) {
+    return 0;
+  }
+  // The same center as restoreNearbyPatches(), so the restore distance is a true hysteresis
+  const GMapping::Point center = particleCenter();
+  GMapping::ScanMatcherMap & first = m_particles.front().map;
+  auto & storage = first.storage();
+  const int magnitude = storage.getPatchMagnitude();
+  const int patch_size = 1 << magnitude;
+  const double delta = first.getDelta();
+  size_t compacted = 0;
+
+  for (int px = 0; px < storage.getXSize(); ++px) {
+    for (int py = 0; py < storage.getYSize(); ++py) {
+      PatchPtr & patch = storage.PatchGrid::cell(px, py);
+      if (!patch) {
+        continue;
+      }
+      const GMapping::IntPoint origin_cell(px << magnitude, py << magnitude);
+      const GMapping::Point origin = first.map2world(origin_cell);
+      const GMapping::Point patch_center(origin.x + patch_size * delta / 2,
+        origin.y + patch_size * delta / 2);
+      const GMapping::Point offset = patch_center - center;
+      if (offset * offset <= distance * distance) {
+        continue;
+      }
+      // Only patches that no particle has written to since they were last shared;
+      // a patch still being updated by some particle differs between particles
+      const Patch * data = &*patch;
+      bool shared = true;
+      for (auto & particle : m_particles) {
+        PatchPtr * other = patchAt(particle.map, origin);
+        if (!other || !*other || &**other != data) {
+          shared = false;
+          break;
+        }
+      }
+      if (!shared) {
+        continue;
+      }
+
+      CompactPatch compact;
+      compact.origin = origin;
+      compact.cells.resize(patch_size * patch_size);
+      for (int x = 0; x < patch_size; ++x) {
+        for (int y = 0; y < patch_size; ++y) {
+          compact.cells[x * patch_size + y] = encodeCell(
+            data->cell(GMapping::IntPoint(x, y)),
+            first.map2world(GMapping::IntPoint(origin_cell.x + x, origin_cell.y + y)), delta);
+        }
+      }
+      compact_patches_.push_back(std::move(compact));
+      for (auto & particle : m_particles) {
+        // the last reference frees the patch
+        *patchAt(particle.map, origin) = PatchPtr(nullptr);
+      }
+      compacted++;
+    }
+  }
+  return compacted;
+}
+
+void ParallelGridSlamProcessor::setCompactRestoreDistance(double distance)
+{
+  restore_distance_ = distance;
+}
+
+size_t ParallelGridSlamProcessor::compactedPatchCount() const
+{
+  return compact_patches_.size();
+}
+
+GMapping::Point ParallelGridSlamProcessor::particleCenter() const
+{
+  GMapping::Point center(0, 0);
+  for (const auto & particle : m_particles) {
+    center.x += particle.pose.x / m_particles.size();
+    center.y += particle.pose.y / m_particles.size();
+  }
+  return center;
+}
+
+void ParallelGridSlamProcessor::restoreNearbyPatches()
+{
+  if (compact_patches_.empty() || m_particles.empty()) {
+    return;
+  }
+  const GMapping::Point center = particleCenter();
+  GMapping::ScanMatcherMap & first = m_particles.front().map;
+  const int patch_size = 1 << first.storage().getPatchMagnitude();
+  const double delta = first.getDelta();
+
+  auto restore = [&](const CompactPatch & compact) {
+      const GMapping::Point offset(
+        compact.origin.x + patch_size * delta / 2 - center.x,
+        compact.origin.y + patch_size * delta / 2 - center.y);
+      if (offset * offset > restore_distance_ * restore_distance_) {
+        return false;
+      }
+      restorePatch(compact);
+      return true;
+    };
+  compact_patches_.erase(
+    std::remove_if(compact_patches_.begin(), compact_patches_.end(), restore),
+    compact_patches_.end());
+}
+
+void ParallelGridSlamProcessor::restoreActivePatches()
+{
+  // Registering a scan allocates the active area. A compacted patch in it would come
+  // back empty and its cells would be lost, so it is restored first.
+  auto restore = [this](const CompactPatch & compact) {
+      for (auto & particle : m_particles) {
+        const auto & storage = particle.map.storage();
+        const GMapping::IntPoint c = particle.map.world2map(compact.origin);
+        const int magnitude = storage.getPatchMagnitude();
+        if (particle.map.isInside(c) &&
+          storage.getActiveArea().count(GMapping::IntPoint(c.x >> magnitude, c.y >> magnitude)))
+        {
+          restorePatch(compact);
+          return true;
+        }
+      }
+      return false;
+    };
+  compact_patches_.erase(
+    std::remove_if(compact_patches_.begin(), compact_patches_.end(), restore),
+    compact_patches_.end());
+}
+
+void ParallelGridSlamProcessor::restorePatch(const CompactPatch & compact)
+{
+  GMapping::ScanMatcherMap & first = m_particles.front().map;
+  const int patch_size = 1 << first.storage().getPatchMagnitude();
+  const double delta = first.getDelta();
+
+  Patch * cells = new Patch(patch_size, patch_size);
+  for (int x = 0; x < patch_size; ++x) {
+    for (int y = 0; y < patch_size; ++y) {
+      const GMapping::Point cell_center(compact.origin.x + x * delta, compact.origin.y + y * delta);
+      cells->cell(x, y) = decodeCell(compact.cells[x * patch_size + y], cell_center, delta);
+    }
+  }
+  PatchPtr restored(cells);
+#ifdef GMAPPING_CUDA
+  if (device_scorer_) {
+    // it may have been allocated at the address of a patch still resident on the device
+    device_scorer_->invalidate(cells);
+  }
+#endif
+  for (auto & particle : m_particles) {
+    PatchPtr * slot = patchAt(particle.map, compact.origin);
+    // a particle that has mapped here again in the meantime keeps its own patch
+    if (slot && !*slot) {
+      *slot = restored;
+    }
+  }
+}
+
+GMapping::OrientedPoint ParallelGridSlamProcessor::drawFromMotion(
+  const GMapping::OrientedPoint & p, const GMapping::OrientedPoint & pnew,
+  const GMapping::OrientedPoint & pold, uint32_t particle) const
+{
+  // same noise model as MotionModel::drawFromMotion()
+  const double srr = m_motionModel.srr;
+  const double srt = m_motionModel.srt;
+  const double str = m_motionModel.str;
+  const double stt = m_motionModel.stt;
+  const double sxy = 0.3 * srr;
+  GMapping::OrientedPoint delta = GMapping::absoluteDifference(pnew, pold);
+  const std::array<double, 2> xy = rng_.gaussian(randomCounter(kMotionStream, particle, 0));
+  const std::array<double, 2> theta = rng_.gaussian(randomCounter(kMotionStream, particle, 1));
+  GMapping::OrientedPoint noisypoint(delta);
+  noisypoint.x += xy[0] * (srr * fabs(delta.x) + str * fabs(delta.theta) +
+    sxy * fabs(delta.y));
+  noisypoint.y += xy[1] * (srr * fabs(delta.y) + str * fabs(delta.theta) +
+    sxy * fabs(delta.x));
+  noisypoint.theta += theta[0] * (stt * fabs(delta.theta) +
+    srt * sqrt(delta.x * delta.x + delta.y * delta.y));
+  noisypoint.theta = fmod(noisypoint.theta, 2 * M_PI);
+  if (noisypoint.theta > M_PI) {
+    noisypoint.theta -= 2 * M_PI;
+  }
+  return GMapping::absoluteSum(p, noisypoint);
+}
+
+Philox::Counter ParallelGridSlamProcessor::randomCounter(
+  RandomStream stream, uint32_t index, uint32_t draw) const
+{
+  // m_readingCount advances on every processScan(), so no counter is used twice
+  return {{static_cast<uint32_t>(m_readingCount), stream, index, draw}};
+}
+
+void ParallelGridSlamProcessor::updateTreeWeights(bool weights_already_normalized)
+{
+  if (!weights_already_normalized) {
+    normalize();
+  }
+  resetTree();
+  propagateWeights();
+}
+
+void ParallelGridSlamProcessor::resetTree()
+{
+  for (auto & particle : m_particles) {
+    for (TNode * n = particle.node; n; n = n->parent) {
+      n->accWeight = 0;
+      n->visitCounter = 0;
+    }
+  }
+}
+
+double ParallelGridSlamProcessor::propagateWeights()
+{
+  double last_node_weight = 0;
+  auto w = m_weights.begin();
+  for (auto & particle : m_particles) {
+    TNode * n = particle.node;
+    n->accWeight = *w;
+    last_node_weight += propagateWeight(n->parent, n->accWeight);
+    w++;
+  }
+  return last_node_weight;
+}
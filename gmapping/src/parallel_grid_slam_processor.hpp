@@ -0,0 +1,202 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2008, Willow Garage, Inc.
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#ifndef PARALLEL_GRID_SLAM_PROCESSOR_HPP_
+#define PARALLEL_GRID_SLAM_PROCESSOR_HPP_
+
+/* OpenSLAM GMapping */
+#include <gmapping/gridfastslam/gridslamprocessor.h>
+#include <gmapping/scanmatcher/scanmatcher.h>
+#include <gmapping/sensor/sensor_range/rangesensor.h>
+
+/* STL includes */
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "beam_scan_matcher.hpp"
+#include "cuda_scan_scorer.hpp"
+#include "node_pool.hpp"
+#include "philox.hpp"
+#include "thread_pool.hpp"
+
+/*
+ * GridSlamProcessor with the per-particle scan matching spread over a thread pool.
+ *
+ * The library keeps scanMatch(), resample() and the tree utilities private and
+ * processScan() is not virtual, so the update step is reimplemented here on top
+ * of the protected particle state. Motion sampling and the const
+ * optimize/likelihood evaluation run concurrently, the latter with a ScanMatcher
+ * per worker; resampling and map registration stay on the calling thread in
+ * particle order. The pose search itself runs on a BeamScanMatcher with
+ * tabulated beam directions. With the CUDA backend the searches of all particles
+ * run in lock step instead, each step's candidates scored together on the device.
+ *
+ * Motion sampling and resampling draw from a counter based generator keyed by
+ * the seed rather than the library's global drand48(). Each draw is addressed by
+ * the reading, the particle and its use, so a seed reproduces the same map at
+ * any thread count and several processors can run side by side in one process.
+ *
+ * To bound memory, map patches far from the robot that all particles share can
+ * be compacted to 16 bits per cell (from a 16 byte PointAccumulator) and are
+ * restored, with their occupancy and mean hit point quantized, once the robot
+ * comes back within the restore distance or a particle registers a scan into them.
+ *
+ * Trajectory nodes come from a NodePool. Once every particle descends from the
+ * same node, the chain above it can be pruned and its scans handed to the caller.
+ */
+class ParallelGridSlamProcessor : public GMapping::GridSlamProcessor
+{
+public:
+  // A scan of the trajectory every particle shares, taken out of the tree
+  struct PrunedScan
+  {
+    GMapping::OrientedPoint pose;
+    // Goes back to the processor's reading pool when reset, from any thread
+    NodePool::ReadingPtr reading;
+  };
+
+  enum class MatcherBackend
+  {
+    kCpu,
+    // needs a build with GMAPPING_CUDA and a CUDA device
+    kCuda,
+  };
+
+  explicit ParallelGridSlamProcessor(std::ostream & infoStr);
+  ~ParallelGridSlamProcessor() override;
+
+  // Same contract as GridSlamProcessor::init(); the root node moves into the node pool
+  void init(
+    unsigned int size, double xmin, double ymin, double xmax, double ymax, double delta,
+    GMapping::OrientedPoint initialPose = GMapping::OrientedPoint(0, 0, 0));
+
+  // Continues a saved session after init(): every particle starts from map, and the
+  // next reading's motion is taken relative to odom_pose, the odometry at the saved pose
+  void resume(const GMapping::ScanMatcherMap & map, const GMapping::OrientedPoint & odom_pose);
+  // Odometry pose of the latest reading
+  GMapping::OrientedPoint odometryPose() const {return m_odoPose;}
+
+  // Number of threads (including the caller) used for scan matching
+  void setThreadCount(unsigned int num_threads);
+  // Seed of this processor's random number streams
+  void setSeed(uint64_t seed);
+  // Where the scan matching candidates are scored. Returns false, and keeps scoring them
+  // on the CPU, if the backend is not available.
+  bool setMatcherBackend(MatcherBackend backend);
+  MatcherBackend matcherBackend() const;
+  // Choose the size of every resampled generation by KLD sampling, within the bounds.
+  // The bounds can be changed between scans.
+  void setAdaptiveParticles(bool enabled, unsigned int min_particles, unsigned int max_particles);
+  // Error bound, upper standard normal quantile and pose histogram bin sizes of KLD sampling
+  void setKldParameters(double err, double z, double xy_bin_size, double theta_bin_size);
+
+  // Bytes held by the particles' map patches; a patch shared between particles counts once
+  size_t mapMemoryUsage() const;
+  // Compacts the patches farther than distance from the particles' mean position that
+  // every particle shares. Returns the number of patches compacted.
+  size_t compactDistantPatches(double distance);
+  // Compacted patches within this distance of the particles' mean position are restored
+  // before matching; a patch a particle is about to register a scan into always is
+  void setCompactRestoreDistance(double distance);
+  size_t compactedPatchCount() const;
+  // Copy the laser and matching parameters of m_matcher to the per-thread matchers.
+  // Call after setSensorMap() and every set*() that touches the matcher.
+  void configureMatchers(const GMapping::RangeSensor & sensor);
+
+  // Same contract as GridSlamProcessor::processScan()
+  bool processScan(const GMapping::RangeReading & reading, int adaptParticles = 0);
+
+  // Frees the nodes above the newest one every particle descends from and appends
+  // their scans to scans, oldest first. Returns the number of scans appended.
+  size_t pruneTree(std::vector<PrunedScan> & scans);
+  size_t trajectoryNodeCount() const;
+  // Lets the readings of released nodes be reused. Call only when no raw reading pointer
+  // taken from the tree before, e.g. for a map update, is still in use.
+  void recycleReadings();
+  // Readings allocated for the trajectory tree so far
+  size_t readingCount() const;
+
+private:
+  // Uses of the random numbers of a reading, each drawn from its own stream
+  enum RandomStream : uint32_t
+  {
+    kMotionStream,
+    kKldStream,
+    kResampleStream,
+  };
+
+  struct CompactPatch
+  {
+    // world position of the patch's first cell
+    GMapping::Point origin;
+    std::vector<uint16_t> cells;
+  };
+
+  GMapping::Point particleCenter() const;
+  void restoreNearbyPatches();
+  void restoreActivePatches();
+  void restorePatch(const CompactPatch & compact);
+  void scanMatch(const double * plain_reading);
+  void registerScan(Particle & particle, const double * plain_reading);
+  void normalize();
+  bool resample(
+    const double * plain_reading, int adapt_size,
+    const GMapping::RangeReading * reading);
+  void resampleIndexes(int adapt_size, RandomStream stream);
+  unsigned int kldSampleCount();
+  GMapping::OrientedPoint drawFromMotion(
+    const GMapping::OrientedPoint & p, const GMapping::OrientedPoint & pnew,
+    const GMapping::OrientedPoint & pold, uint32_t particle) const;
+  Philox::Counter randomCounter(RandomStream stream, uint32_t index, uint32_t draw) const;
+  void updateTreeWeights(bool weights_already_normalized);
+  void resetTree();
+  double propagateWeights();
+
+  std::unique_ptr<ThreadPool> pool_ = nullptr;
+  NodePool node_pool_;
+  Philox rng_;
+  // One matcher per pool worker; ScanMatcher cannot be copied
+  std::vector<std::unique_ptr<GMapping::ScanMatcher>> matchers_;
+  // Pose search of the scan matching; only read while matching, so the workers share it
+  BeamScanMatcher beam_matcher_;
+  // Set with the CUDA backend
+  std::shared_ptr<CudaScanScorer> device_scorer_;
+  BeamScanMatcher::BatchSearch device_search_;
+  std::vector<const GMapping::ScanMatcherMap *> device_maps_;
+  // Scratch buffers of the update step, kept so their capacity is reused
+  std::vector<double> plain_reading_;
+  TNodeVector old_generation_;
+  ParticleVector next_generation_;
+  std::vector<unsigned int> deleted_particles_;
+
+  bool adaptive_particles_ = false;
+  unsigned int min_particles_ = 1;
+  unsigned int max_particles_ = 1;
+  double kld_err_ = 0.01;
+  double kld_z_ = 2.33;
+  double kld_xy_bin_size_ = 0.5;
+  double kld_theta_bin_size_ = 0.175;
+  std::vector<std::array<int, 3>> kld_bins_;
+
+  std::vector<CompactPatch> compact_patches_;
+  double restore_distance_ = 0.0;
+};
+
+#endif  // PARALLEL_GRID_SLAM_PROCESSOR_HPP_
@@ -0,0 +1,86 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#ifndef PHILOX_HPP_
+#define PHILOX_HPP_
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+/*
+ * Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3",
+ * SC 2011): a keyed bijection of a 128 bit counter. Every counter gives its own
+ * four random words, so a draw depends only on the key and on the counter it is
+ * taken at, never on how many draws other threads made before it.
+ */
+class Philox
+{
+public:
+  using Counter = std::array<uint32_t, 4>;
+
+  explicit Philox(uint64_t key = 0)
+  : key_{{static_cast<uint32_t>(key), static_cast<uint32_t>(key >> 32)}}
+  {
+  }
+
+  Counter operator()(Counter counter) const
+  {
+    std::array<uint32_t, 2> key = key_;
+    for (int round = 0; round < 10; ++round) {
+      if (round > 0) {
+        key[0] += 0x9E3779B9u;
+        key[1] += 0xBB67AE85u;
+      }
+      const uint64_t product0 = static_cast<uint64_t>(0xD2511F53u) * counter[0];
+      const uint64_t product1 = static_cast<uint64_t>(0xCD9E8D57u) * counter[2];
+      counter = {{
+        static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key[0],
+        static_cast<uint32_t>(product1),
+        static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key[1],
+        static_cast<uint32_t>(product0)}};
+    }
+    return counter;
+  }
+
+  // Two uniform draws in (0, 1] from the words of counter
+  std::array<double, 2> uniform(const Counter & counter) const
+  {
+    const Counter words = (*this)(counter);
+    return {{toUniform(words[0], words[1]), toUniform(words[2], words[3])}};
+  }
+
+  // Two independent standard normal draws from counter (Box-Muller)
+  std::array<double, 2> gaussian(const Counter & counter) const
+  {
+    const std::array<double, 2> u = uniform(counter);
+    const double radius = std::sqrt(-2.0 * std::log(u[0]));
+    const double angle = 2.0 * M_PI * u[1];
+    return {{radius * std::cos(angle), radius * std::sin(angle)}};
+  }
+
+private:
+  static double toUniform(uint32_t high, uint32_t low)
+  {
+    // 53 random bits, shifted by one so that log() never sees zero
+    const uint64_t bits = ((static_cast<uint64_t>(high) << 32) | low) >> 11;
+    return (bits + 1) * (1.0 / 9007199254740992.0);
+  }
+
+  std::array<uint32_t, 2> key_;
+};
+
+#endif  // PHILOX_HPP_
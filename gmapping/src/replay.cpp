@@ -14,75 +14,83 @@
  * limitations under the License.
  *
 */
-#include "slam_gmapping.h"
 
+#include <rclcpp/rclcpp.hpp>
+
+#include <cstdlib>
+#include <exception>
 #include <iostream>
 #include <string>
+#include <vector>
+
+#include "slam_gmapping.hpp"
 
-#include <boost/program_options.hpp>
-#include <ros/ros.h>
+void print_usage()
+{
+  std::cout << "Usage: slam_gmapping_replay --bag_filename <bag> [options] [--ros-args ...]" <<
+    std::endl <<
+    "Options:" << std::endl <<
+    "  --help                 Print help messages" << std::endl <<
+    "  --bag_filename <bag>   rosbag2 recording to map" << std::endl <<
+    "  --scan_topic <topic>   topic that contains the LaserScan in the bag (default: /scan)" <<
+    std::endl <<
+    "  --on_done <command>    command to execute when done, instead of serving the map" <<
+    std::endl;
+}
 
-int
-main(int argc, char** argv)
+int main(int argc, char ** argv)
 {
-    /** Define and parse the program options 
-     */ 
-    namespace po = boost::program_options; 
-    po::options_description desc("Options"); 
-    desc.add_options() 
-    ("help", "Print help messages") 
-    ("scan_topic",  po::value<std::string>()->default_value("/scan") ,"topic that contains the laserScan in the rosbag")
-    ("bag_filename", po::value<std::string>()->required(), "ros bag filename") 
-    ("seed", po::value<unsigned long int>()->default_value(0), "seed")
-    ("max_duration_buffer", po::value<unsigned long int>()->default_value(99999), "max tf buffer duration")
-    ("on_done", po::value<std::string>(), "command to execute when done") ;
-    
-    po::variables_map vm; 
-    try 
-    { 
-        po::store(po::parse_command_line(argc, argv, desc),  
-                  vm); // can throw 
-        
-        /** --help option 
-         */ 
-        if ( vm.count("help")  ) 
-        { 
-            std::cout << "Basic Command Line Parameter App" << std::endl 
-            << desc << std::endl; 
-            return 0; 
-        } 
-        
-        po::notify(vm); // throws on error, so do after help in case 
-        // there are any problems 
-    } 
-    catch(po::error& e) 
-    { 
-        std::cerr << "ERROR: " << e.what() << std::endl << std::endl; 
-        std::cerr << desc << std::endl; 
-        return -1; 
-    } 
-    
-    std::string bag_fname = vm["bag_filename"].as<std::string>();
-    std::string scan_topic = vm["scan_topic"].as<std::string>();
-    unsigned long int seed = vm["seed"].as<unsigned long int>();
-    unsigned long int max_duration_buffer = vm["max_duration_buffer"].as<unsigned long int>();
-    
-    ros::init(argc, argv, "slam_gmapping");
-    SlamGMapping gn(seed, max_duration_buffer) ;
-    gn.startReplay(bag_fname, scan_topic);
-    ROS_INFO("replay stopped.");
+  setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+  rclcpp::init(argc, argv);
 
-    if ( vm.count("on_done") )
-    {
-        // Run the "on_done" command and then exit
-        system(vm["on_done"].as<std::string>().c_str());
+  std::string bag_fname;
+  std::string scan_topic = "/scan";
+  std::string on_done;
+  std::vector<std::string> args = rclcpp::remove_ros_arguments(argc, argv);
+  for (size_t i = 1; i < args.size(); ++i) {
+    if (args[i] == "--help") {
+      print_usage();
+      rclcpp::shutdown();
+      return 0;
+    } else if (i + 1 < args.size() && args[i] == "--bag_filename") {
+      bag_fname = args[++i];
+    } else if (i + 1 < args.size() && args[i] == "--scan_topic") {
+      scan_topic = args[++i];
+    } else if (i + 1 < args.size() && args[i] == "--on_done") {
+      on_done = args[++i];
+    } else {
+      std::cerr << "ERROR: unknown or incomplete option '" << args[i] << "'" << std::endl;
+      print_usage();
+      rclcpp::shutdown();
+      return -1;
     }
-    else
-    {
-        ros::spin(); // wait so user can save the map
+  }
+  if (bag_fname.empty()) {
+    std::cerr << "ERROR: --bag_filename is required" << std::endl;
+    print_usage();
+    rclcpp::shutdown();
+    return -1;
+  }
+
+  auto node = std::make_shared<SlamGMapping>(rclcpp::NodeOptions(), false);
+  try {
+    node->startReplay(bag_fname, scan_topic);
+  } catch (const std::exception & e) {
+    RCLCPP_ERROR(node->get_logger(), "Replay of '%s' failed: %s", bag_fname.c_str(), e.what());
+    rclcpp::shutdown();
+    return 1;
+  }
+  RCLCPP_INFO(node->get_logger(), "replay stopped.");
+
+  if (!on_done.empty()) {
+    // Run the "on_done" command and then exit
+    if (system(on_done.c_str()) != 0) {
+      RCLCPP_WARN(node->get_logger(), "'%s' failed", on_done.c_str());
     }
-    return(0);
-    
-    
+  } else {
+    // wait so user can save the map
+    rclcpp::spin(node);
+  }
+  rclcpp::shutdown();
+  return 0;
 }
-
@@ -37,14 +37,23 @@ written to a file using e.g.
 Subscribes to (name/type):
 - @b "scan"/<a href="../../sensor_msgs/html/classstd__msgs_1_1LaserScan.html">sensor_msgs/LaserScan</a> : data from a laser range scanner
 - @b "/tf": odometry from the robot
+- @b "<~extra_scan_topics>"/sensor_msgs/LaserScan : scans of further lasers, fused into the scans on "scan"
+- @b "<~odom_topic>"/nav_msgs/Odometry : odometry, if ~publish_map_pose
 
 
 Publishes to (name/type):
 - @b "/tf"/tf/tfMessage: position relative to the map
+- @b "map"/nav_msgs/OccupancyGrid: the full map, at most every ~map_full_publish_interval
+- @b "map_updates"/map_msgs/OccupancyGridUpdate: tiles of the map that changed since the last update
+- @b "map_compressed"/gmapping_msgs/CompressedOccupancyGrid: the full map run-length encoded, every map update if ~publish_compressed_map
+- @b "map_lowres/<level>"/nav_msgs/OccupancyGrid: the map at 2^level times its cell size, for level 1 to ~map_pyramid_levels, every map update
+- @b "map_pose"/nav_msgs/Odometry: the odometry moved into the map frame with the latest correction, for every odometry message if ~publish_map_pose
+- @b "diagnostics"/diagnostic_msgs/DiagnosticArray: scan counters and per-stage latency percentiles, every ~diagnostics_period
 
 
 @section services
  - @b "~dynamic_map" : returns the map
+ - @b "~dynamic_map_lowres"/gmapping_msgs/GetMapLevel : returns the coarsest pyramid level no coarser than the requested resolution
 
 
 @section parameters ROS parameters
@@ -53,11 +62,32 @@ Reads the following parameters from the parameter server
 
 Parameters used by our GMapping wrapper:
 
-- @b "~throttle_scans": @b [int] throw away every nth laser scan
+- @b "~throttle_scans": @b [int] throw away every nth laser scan (ignored with scan_latency_budget)
+- @b "~scan_latency_budget": @b [double] target time in seconds from receiving a scan until it is processed. Stale scans are skipped in favour of the freshest one and the processing rate is adapted to hold the budget (0 = use throttle_scans)
+- @b "~scan_queue_size": @b [int] number of scans kept while waiting for their odom transform; the oldest is dropped when full
+- @b "~extra_scan_topics": @b [string array] topics of further lasers whose scans are fused into the ones on scan
+- @b "~scan_sync_tolerance": @b [double] largest time in seconds between a scan and an extra scan fused into it
+- @b "~diagnostics_period": @b [double] time in seconds between two diagnostics messages (0 = do not publish)
 - @b "~base_frame": @b [string] the tf frame_id to use for the robot base pose
 - @b "~map_frame": @b [string] the tf frame_id where the robot pose on the map is published
 - @b "~odom_frame": @b [string] the tf frame_id from which odometry is read
+- @b "~publish_map_pose": @b [bool] republish the odometry in the map frame on map_pose
+- @b "~odom_topic": @b [string] the odometry topic read with publish_map_pose
 - @b "~map_update_interval": @b [double] time in seconds between two recalculations of the map
+- @b "~map_tile_size": @b [int] edge length in cells of the tiles published on map_updates
+- @b "~map_full_publish_interval": @b [double] minimum time in seconds between two full maps on map; changed tiles are published in between (0 = publish the full map on every update)
+- @b "~publish_compressed_map": @b [bool] also publish every map update run-length encoded on map_compressed
+- @b "~map_pyramid_levels": @b [int] number of downsampled maps published on map_lowres, each at half the resolution of the one before
+- @b "~crop_map": @b [bool] publish only the observed part of the map, with some margin, instead of the whole map
+- @b "~incremental_map_update": @b [bool] only render trajectory nodes added since the last map update, rebuilding the map when the best particle or its ancestry changes
+- @b "~prune_trajectory": @b [bool] free the part of the trajectory tree all particles agree on, keeping its scans only in a base map that rebuilds start from, so memory and rebuild time stop growing with the length of the run
+- @b "~beam_bin_size": @b [int] number of consecutive laser beams binned into one that keeps the shortest range (1 = no binning)
+- @b "~beam_drop_unusable": @b [bool] drop beams beyond maxUrange instead of clearing free space along them
+- @b "~beam_feature_threshold": @b [double] adaptive decimation: keep beams whose endpoint is farther than this from the line through its neighbours' endpoints [m], and one in every beam_max_gap otherwise (0 = keep all beams)
+- @b "~beam_max_gap": @b [int] with adaptive decimation, the largest number of consecutive beams left out
+- @b "~checkpoint_file": @b [string] file the map builder saves the best map and pose to, every checkpoint_interval (empty = no checkpoints)
+- @b "~checkpoint_interval": @b [double] minimum time in seconds between two checkpoints
+- @b "~resume_from": @b [string] checkpoint file to continue mapping from; the robot is taken to have moved by its odometry since the checkpoint (empty = start a new map)
 
 
 Parameters used by GMapping itself:
@@ -86,7 +116,19 @@ Others:
 - @b "~/angularUpdate" @b [double] the robot only processes new measurements if the robot has turned at least this many rads
 
 - @b "~/resampleThreshold" @b [double] threshold at which the particles get resampled. Higher means more frequent resampling.
-- @b "~/particles" @b [int] (fixed) number of particles. Each particle represents a possible trajectory that the robot has traveled
+- @b "~/particles" @b [int] number of particles (the initial number with adaptive_particles). Each particle represents a possible trajectory that the robot has traveled
+- @b "~/adaptive_particles" @b [bool] size every resampled particle set by KLD sampling between min_particles and max_particles
+- @b "~/min_particles" @b [int] minimum number of particles with adaptive_particles
+- @b "~/max_particles" @b [int] maximum number of particles with adaptive_particles
+- @b "~/kld_err" @b [double] maximum error between the true and the sampled distribution in KLD sampling
+- @b "~/kld_z" @b [double] upper standard normal quantile for the probability that the error stays below kld_err
+- @b "~/kld_xy_bin_size" @b [double] size of the KLD sampling histogram bins in x and y [m]
+- @b "~/kld_theta_bin_size" @b [double] size of the KLD sampling histogram bins in theta [rad]
+- @b "~/particle_time_budget" @b [double] with adaptive_particles, lower max_particles so that processing a scan takes at most this many seconds (0 = no budget)
+- @b "~/map_memory_budget" @b [double] memory the particle maps may use [MB]; beyond it, map patches far from the robot are stored lossily at 2 bytes per cell until the robot returns (0 = no budget)
+- @b "~/num_threads" @b [int] number of threads used to scan match the particles and to render long trajectories into the map (0 = one per core). The result does not depend on it.
+- @b "~/scan_matcher_backend" @b [string] where the scan matching candidates are scored: "cpu", or "cuda" to score those of all particles together on the GPU (needs a build with GMAPPING_CUDA; falls back to the CPU without a device)
+- @b "~/seed" @b [int] seed of the particle sampling; the same seed and input give the same map (-1 = seed from the clock)
 
 Likelihood sampling (used in scan matching)
 - @b "~/llsamplerange" @b [double] linear range
@@ -107,25 +149,30 @@ Initial map dimensions and resolution:
 #include "slam_gmapping.hpp"
 /* #include "ros/console.h" */
 
-/* #include <rosbag/bag.h> */
-/* #include <rosbag/view.h> */
-
 // compute linear index for given map coords
 #define MAP_IDX(sx, i, j) ((sx) * (j) + (i))
 
 SlamGMapping::SlamGMapping(const rclcpp::NodeOptions & options)
+: SlamGMapping(options, true)
+{
+}
+
+SlamGMapping::SlamGMapping(const rclcpp::NodeOptions & options, bool live_slam)
 : rclcpp::Node("slam_gmapping", options)
 {
   tfB_ = std::make_unique<tf2_ros::TransformBroadcaster>(this);
   buffer = std::make_unique<tf2_ros::Buffer>(this->get_clock());
   /* buffer->setUsingDedicatedThread(true); */
-  tf_node_ = std::make_shared<rclcpp::Node>("slam_gmapping_tf", options);
-  tf_ = std::make_unique<tf2_ros::TransformListener>(*buffer, tf_node_, true);
-  map_to_odom_.setIdentity();
-
-  seed_ = time(NULL);
+  if (live_slam) {
+    // The listener node must not pick up the remappings (e.g. the node name) a
+    // component container passes to this node
+    tf_node_ = std::make_shared<rclcpp::Node>(
+      "slam_gmapping_tf", rclcpp::NodeOptions(options).arguments({}));
+    tf_ = std::make_unique<tf2_ros::TransformListener>(*buffer, tf_node_, true);
+  }
+  storeMapToOdom(tf2::Transform::getIdentity());
 
-  gsp_ = new GMapping::GridSlamProcessor(std::cerr);
+  gsp_ = new ParallelGridSlamProcessor(std::cerr);
   if (!gsp_) {
     RCLCPP_ERROR(this->get_logger(), "Failed to allocate GridSlamProcessor!");
     exit(1);
@@ -135,11 +182,21 @@ SlamGMapping::SlamGMapping(const rclcpp::NodeOptions & options)
   }
 
   init();
-  startLiveSlam();
+  if (live_slam) {
+    startLiveSlam();
+  }
 }
 
 SlamGMapping::~SlamGMapping()
 {
+  {
+    std::lock_guard<std::mutex> update_lock(map_update_mutex_);
+    map_thread_running_ = false;
+  }
+  map_update_cv_.notify_all();
+  if (map_thread_.joinable()) {
+    map_thread_.join();
+  }
   delete gsp_;
   if (gsp_laser_) {
     delete gsp_laser_;
@@ -154,11 +211,38 @@ void SlamGMapping::init()
   //gsp_ = new GMapping::GridSlamProcessor(std::cerr);
   // Parameters used by our GMapping wrapper
   throttle_scans_ = this->declare_parameter("throttle_scans", 1);
+  scan_latency_budget_ = this->declare_parameter("scan_latency_budget", 0.0);
+  scan_queue_size_ = std::max(1, static_cast<int>(this->declare_parameter("scan_queue_size", 5)));
+  diagnostics_period_ = this->declare_parameter("diagnostics_period", 1.0);
+  incremental_map_update_ = this->declare_parameter("incremental_map_update", true);
+  prune_trajectory_ = this->declare_parameter("prune_trajectory", false);
+  map_tile_size_ = std::max(1, static_cast<int>(this->declare_parameter("map_tile_size", 64)));
+  map_pyramid_.resize(std::max(0, static_cast<int>(
+      this->declare_parameter("map_pyramid_levels", 0))));
+  publish_compressed_map_ = this->declare_parameter("publish_compressed_map", false);
+  map_full_publish_interval_ = this->declare_parameter("map_full_publish_interval", 0.0);
+  // Scans of these topics are fused into the ones on "scan"
+  for (const auto & topic : this->declare_parameter(
+      "extra_scan_topics", std::vector<std::string>()))
+  {
+    ExtraLaser laser;
+    laser.topic = topic;
+    extra_lasers_.push_back(std::move(laser));
+  }
+  scan_sync_tolerance_ = this->declare_parameter("scan_sync_tolerance", 0.05);
+  // Publish only the observed part of the map instead of the whole xmin..ymax box
+  crop_map_ = this->declare_parameter("crop_map", false);
+  checkpoint_file_ = this->declare_parameter("checkpoint_file", std::string(""));
+  checkpoint_interval_ = this->declare_parameter("checkpoint_interval", 60.0);
+  resume_from_ = this->declare_parameter("resume_from", std::string(""));
   base_frame_ = this->declare_parameter("base_frame", std::string("base_link"));
   map_frame_ = this->declare_parameter("map_frame", std::string("map"));
   odom_frame_ = this->declare_parameter("odom_frame", std::string("odom"));
 
   transform_publish_period_ = this->declare_parameter("transform_publish_period", 0.05);
+  // Publish odom_topic moved into the map frame on map_pose, as each message arrives
+  publish_map_pose_ = this->declare_parameter("publish_map_pose", false);
+  odom_topic_ = this->declare_parameter("odom_topic", std::string("odom"));
 
   double tmp;
   tmp = this->declare_parameter("map_update_interval",  5.0);
@@ -175,6 +259,16 @@ void SlamGMapping::init()
   lsigma_ = this->declare_parameter("lsigma", 0.075);
   ogain_ = this->declare_parameter("ogain", 3.0);
   lskip_ = this->declare_parameter("lskip", 0);
+  // Beams binned into one by the beam filter, keeping the shortest range
+  beam_bin_size_ = std::max(1, static_cast<int>(
+      this->declare_parameter("beam_bin_size", 1)));
+  // Drop beams beyond maxUrange instead of clearing free space along them
+  beam_drop_unusable_ = this->declare_parameter("beam_drop_unusable", false);
+  // Adaptive decimation: keep beams off the line through their neighbours by more
+  // than this [m], and one beam in every beam_max_gap otherwise; 0 disables it
+  beam_feature_threshold_ = this->declare_parameter("beam_feature_threshold", 0.0);
+  beam_max_gap_ = std::max(1, static_cast<int>(
+      this->declare_parameter("beam_max_gap", 4)));
   srr_ = this->declare_parameter("srr", 0.1);
   srt_ = this->declare_parameter("srt", 0.2);
   str_ = this->declare_parameter("str", 0.1);
@@ -184,6 +278,25 @@ void SlamGMapping::init()
   temporalUpdate_ = this->declare_parameter("temporalUpdate", -1.0);
   resampleThreshold_ = this->declare_parameter("resampleThreshold", 0.5);
   particles_ = this->declare_parameter("particles", 30);
+  adaptive_particles_ = this->declare_parameter("adaptive_particles", false);
+  min_particles_ = std::max(1, static_cast<int>(this->declare_parameter("min_particles", 10)));
+  max_particles_ = std::max(min_particles_,
+      static_cast<int>(this->declare_parameter("max_particles", 100)));
+  kld_err_ = this->declare_parameter("kld_err", 0.01);
+  kld_z_ = this->declare_parameter("kld_z", 2.33);
+  kld_xy_bin_size_ = this->declare_parameter("kld_xy_bin_size", 0.5);
+  kld_theta_bin_size_ = this->declare_parameter("kld_theta_bin_size", 0.175);
+  particle_time_budget_ = this->declare_parameter("particle_time_budget", 0.0);
+  map_memory_budget_ = this->declare_parameter("map_memory_budget", 0.0) * 1024 * 1024;
+  num_threads_ = this->declare_parameter("num_threads", 1);
+  if (num_threads_ <= 0) {
+    num_threads_ = std::max(1u, std::thread::hardware_concurrency());
+  }
+  scan_matcher_backend_ = this->declare_parameter("scan_matcher_backend", std::string("cpu"));
+  const int64_t seed = this->declare_parameter("seed", static_cast<int64_t>(-1));
+  if (seed >= 0) {
+    seed_ = seed;
+  }
   xmin_ = this->declare_parameter("xmin", -100.0);
   ymin_ = this->declare_parameter("ymin", -100.0);
   xmax_ = this->declare_parameter("xmax", 100.0);
@@ -196,108 +309,164 @@ void SlamGMapping::init()
   tf_delay_ = this->declare_parameter("tf_delay", transform_publish_period_);
 }
 
-void SlamGMapping::startLiveSlam()
+void SlamGMapping::advertise()
 {
   /* create publishers */
   entropy_publisher_ = this->create_publisher<std_msgs::msg::Float64>("entropy", 1);
   sst_ = this->create_publisher<nav_msgs::msg::OccupancyGrid>("map", 1);
   sstm_ = this->create_publisher<nav_msgs::msg::MapMetaData>("map_metadata", 1);
+  sstu_ = this->create_publisher<map_msgs::msg::OccupancyGridUpdate>("map_updates", 10);
+  diagnostics_publisher_ =
+    this->create_publisher<diagnostic_msgs::msg::DiagnosticArray>("diagnostics", 1);
+  /*
+   * Scans, the transform timer and the map service each get their own group, so a
+   * MultiThreadedExecutor can keep broadcasting map->odom while a scan is processed.
+   */
+  scan_callback_group_ = this->create_callback_group(rclcpp::CallbackGroupType::MutuallyExclusive);
+  transform_callback_group_ =
+    this->create_callback_group(rclcpp::CallbackGroupType::MutuallyExclusive);
+  map_callback_group_ = this->create_callback_group(rclcpp::CallbackGroupType::MutuallyExclusive);
   /* create services */
   ss_ = this->create_service<nav_msgs::srv::GetMap>(
     "dynamic_map",
-    std::bind(&SlamGMapping::mapCallback, this, std::placeholders::_1, std::placeholders::_2));
+    std::bind(&SlamGMapping::mapCallback, this, std::placeholders::_1, std::placeholders::_2),
+    rmw_qos_profile_services_default, map_callback_group_);
+  ss_level_ = this->create_service<gmapping_msgs::srv::GetMapLevel>(
+    "dynamic_map_lowres",
+    std::bind(&SlamGMapping::mapLevelCallback, this, std::placeholders::_1,
+    std::placeholders::_2),
+    rmw_qos_profile_services_default, map_callback_group_);
+  if (publish_compressed_map_) {
+    map_compressed_publisher_ =
+      this->create_publisher<gmapping_msgs::msg::CompressedOccupancyGrid>("map_compressed", 1);
+  }
+  for (size_t level = 1; level <= map_pyramid_.size(); ++level) {
+    map_pyramid_publishers_.push_back(this->create_publisher<nav_msgs::msg::OccupancyGrid>(
+        "map_lowres/" + std::to_string(level), 1));
+  }
+  /* create the map builder thread */
+  map_thread_running_ = true;
+  map_thread_ = std::thread(&SlamGMapping::mapUpdateLoop, this);
+}
+
+void SlamGMapping::startLiveSlam()
+{
+  advertise();
   /* create subscribers */
   rclcpp::QoS qos{rclcpp::QoS(1).durability_volatile()};
+  rclcpp::SubscriptionOptions scan_options;
+  scan_options.callback_group = scan_callback_group_;
+  // A laser driver in the same process hands its scans over without serializing them,
+  // whatever the node's default. The callbacks share ownership, so rclcpp moves a
+  // published unique_ptr into them instead of copying it.
+  scan_options.use_intra_process_comm = rclcpp::IntraProcessSetting::Enable;
   scan_filter_sub_ = this->create_subscription<sensor_msgs::msg::LaserScan>(
-    "scan", qos, std::bind(&SlamGMapping::laserCallback, this, std::placeholders::_1));
-
-  /*
-   * TODO(allenh1): re-enable message filters
-   */
-
-  // scan_filter_ = new tf::MessageFilter<sensor_msgs::LaserScan>(*scan_filter_sub_, tf_, odom_frame_, 5);
-  // scan_filter_->registerCallback(std::bind(&SlamGMapping::laserCallback, this, std::placeholders::_1));
+    "scan", qos, std::bind(&SlamGMapping::laserCallback, this, std::placeholders::_1),
+    scan_options);
+  for (size_t i = 0; i < extra_lasers_.size(); ++i) {
+    extra_lasers_[i].subscription = this->create_subscription<sensor_msgs::msg::LaserScan>(
+      extra_lasers_[i].topic, qos,
+      std::bind(&SlamGMapping::extraLaserCallback, this, i, std::placeholders::_1),
+      scan_options);
+  }
+  // Scans that arrive ahead of odometry wait in scan_queue_; this retries them once
+  // their transform shows up instead of waiting for the next scan
+  scan_queue_timer_ = this->create_wall_timer(
+    std::chrono::milliseconds(10), std::bind(&SlamGMapping::processScanQueue, this),
+    scan_callback_group_);
   /* create the transform thread */
   auto converted =
     std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::duration<double>(transform_publish_period_));
-  m_timer = this->create_wall_timer(converted, std::bind(&SlamGMapping::publishTransform, this));
+  m_timer = this->create_wall_timer(
+    converted, std::bind(&SlamGMapping::publishTransform, this), transform_callback_group_);
+  if (publish_map_pose_) {
+    // Reads the correction like the transform timer does, so it never waits for a scan
+    map_pose_publisher_ = this->create_publisher<nav_msgs::msg::Odometry>("map_pose", 10);
+    rclcpp::SubscriptionOptions odom_options;
+    odom_options.callback_group = transform_callback_group_;
+    odom_sub_ = this->create_subscription<nav_msgs::msg::Odometry>(
+      odom_topic_, rclcpp::SensorDataQoS(),
+      std::bind(&SlamGMapping::odomCallback, this, std::placeholders::_1), odom_options);
+  }
+  if (diagnostics_period_ > 0.0) {
+    diagnostics_timer_ = this->create_wall_timer(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::duration<double>(diagnostics_period_)),
+      std::bind(&SlamGMapping::publishDiagnostics, this), map_callback_group_);
+  }
 }
 
 /*
- * TODO(allenh1): replay from rosbag. We don't have rosbag yet.
+ * Reads the bag directly and feeds it through the same path as live data: /tf and
+ * /tf_static go into the buffer, scans into laserCallback(). Nothing is paced, so the
+ * bag is processed as fast as the mapper keeps up.
  */
-void SlamGMapping::startReplay(const std::string & bag_fname, std::string scan_topic)
-{
-  if (!bag_fname.size() || !scan_topic.size()) { /* Shut up, GCC */
-    RCLCPP_ERROR(this->get_logger(), "bag name or scan_topic cannot be empty!");
-  }
-  throw std::runtime_error("The SlamGMapping::startReplay function has not been implemented yet");
-//   double transform_publish_period;
-//   ros::NodeHandle private_nh_("~");
-//   entropy_publisher_ = private_nh_.advertise<std_msgs::Float64>("entropy", 1, true);
-//   sst_ = node_.advertise<nav_msgs::OccupancyGrid>("map", 1, true);
-//   sstm_ = node_.advertise<nav_msgs::MapMetaData>("map_metadata", 1, true);
-//   ss_ = node_.advertiseService("dynamic_map", &SlamGMapping::mapCallback, this);
-
-//   rosbag::Bag bag;
-//   bag.open(bag_fname, rosbag::bagmode::Read);
-
-//   std::vector<std::string> topics;
-//   topics.push_back(std::string("/tf"));
-//   topics.push_back(scan_topic);
-//   rosbag::View viewall(bag, rosbag::TopicQuery(topics));
-
-//   // Store up to 5 messages and there error message (if they cannot be processed right away)
-//   std::queue<std::pair<sensor_msgs::LaserScan::ConstPtr, std::string> > s_queue;
-//   for (rosbag::MessageInstance const m : viewall)
-//   {
-//     tf::tfMessage::ConstPtr cur_tf = m.instantiate<tf::tfMessage>();
-//     if (cur_tf != NULL) {
-//       for (size_t i = 0; i < cur_tf->transforms.size(); ++i)
-//       {
-//         geometry_msgs::TransformStamped transformStamped;
-//         tf::StampedTransform stampedTf;
-//         transformStamped = cur_tf->transforms[i];
-//         tf::transformStampedMsgToTF(transformStamped, stampedTf);
-//         tf_.setTransform(stampedTf);
-//       }
-//     }
-
-//     sensor_msgs::LaserScan::ConstPtr s = m.instantiate<sensor_msgs::LaserScan>();
-//     if (s != NULL) {
-//       if (!(ros::Time(s->header.stamp)).is_zero())
-//       {
-//         s_queue.push(std::make_pair(s, ""));
-//       }
-//       // Just like in live processing, only process the latest 5 scans
-//       if (s_queue.size() > 5) {
-//         ROS_WARN_STREAM("Dropping old scan: " << s_queue.front().second);
-//         s_queue.pop();
-//       }
-//       // ignoring un-timestamped tf data
-//     }
-
-//     // Only process a scan if it has tf data
-//     while (!s_queue.empty())
-//     {
-//       try
-//       {
-//         tf::StampedTransform t;
-//         tf_.lookupTransform(s_queue.front().first->header.frame_id, odom_frame_, s_queue.front().first->header.stamp, t);
-//         this->laserCallback(s_queue.front().first);
-//         s_queue.pop();
-//       }
-//       // If tf does not have the data yet
-//       catch(tf2::TransformException& e)
-//       {
-//         // Store the error to display it if we cannot process the data after some time
-//         s_queue.front().second = std::string(e.what());
-//         break;
-//       }
-//     }
-//   }
-
-//   bag.close();
+size_t SlamGMapping::startReplay(const std::string & bag_fname, std::string scan_topic)
+{
+  if (!bag_fname.size() || !scan_topic.size()) {
+    throw std::invalid_argument("bag name or scan_topic cannot be empty!");
+  }
+  advertise();
+
+  rosbag2_cpp::StorageOptions storage_options;
+  storage_options.uri = bag_fname;
+  storage_options.storage_id = "sqlite3";
+  rosbag2_cpp::ConverterOptions converter_options;
+  converter_options.input_serialization_format = "cdr";
+  converter_options.output_serialization_format = "cdr";
+  rosbag2_cpp::readers::SequentialReader reader;
+  reader.open(storage_options, converter_options);
+
+  rclcpp::Serialization<tf2_msgs::msg::TFMessage> tf_serialization;
+  rclcpp::Serialization<sensor_msgs::msg::LaserScan> scan_serialization;
+  size_t scan_count = 0;
+  const auto replay_start = std::chrono::steady_clock::now();
+  while (reader.has_next()) {
+    std::shared_ptr<rosbag2_storage::SerializedBagMessage> bag_message = reader.read_next();
+    const bool is_static = bag_message->topic_name == "/tf_static";
+    if (is_static || bag_message->topic_name == "/tf") {
+      rclcpp::SerializedMessage serialized(*bag_message->serialized_data);
+      tf2_msgs::msg::TFMessage tf_message;
+      tf_serialization.deserialize_message(&serialized, &tf_message);
+      for (const auto & transform : tf_message.transforms) {
+        buffer->setTransform(transform, "rosbag", is_static);
+      }
+      // Scans recorded ahead of their odometry can go now
+      processScanQueue();
+    } else if (bag_message->topic_name == scan_topic) {
+      rclcpp::SerializedMessage serialized(*bag_message->serialized_data);
+      auto scan = std::make_shared<sensor_msgs::msg::LaserScan>();
+      scan_serialization.deserialize_message(&serialized, scan.get());
+      // ignoring un-timestamped scans
+      if (scan->header.stamp.sec == 0 && scan->header.stamp.nanosec == 0) {
+        continue;
+      }
+      scan_count++;
+      laserCallback(scan);
+    } else {
+      for (size_t i = 0; i < extra_lasers_.size(); ++i) {
+        if (bag_message->topic_name == extra_lasers_[i].topic) {
+          rclcpp::SerializedMessage serialized(*bag_message->serialized_data);
+          auto scan = std::make_shared<sensor_msgs::msg::LaserScan>();
+          scan_serialization.deserialize_message(&serialized, scan.get());
+          extraLaserCallback(i, scan);
+        }
+      }
+    }
+  }
+
+  // Render the map of the final trajectory, whatever map_update_interval says
+  if (got_first_scan_) {
+    scheduleMapUpdate();
+  }
+  waitForMapUpdates();
+  const double elapsed = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - replay_start).count();
+  RCLCPP_INFO(this->get_logger(),
+    "Replayed %zu scans in %.2f s (%.1f scans/s), %zu dropped waiting for %s",
+    scan_count, elapsed, elapsed > 0.0 ? scan_count / elapsed : 0.0,
+    droppedScanCount(), odom_frame_.c_str());
+  return scan_count;
 }
 
 void
@@ -318,32 +487,24 @@ SlamGMapping::publishLoop(double transform_publish_period)
 bool
 SlamGMapping::getOdomPose(GMapping::OrientedPoint & gmap_pose, const auto & t)
 {
-  // Get the pose of the centered laser at the right time
+  // Get the pose of the centered laser at the right time. Only base->odom changes
+  // between scans, the laser's mounting on the base was cached in initMapper()
   tf2::TimePoint tp = tf2::TimePoint(
     std::chrono::seconds(t.sec) + std::chrono::nanoseconds(t.nanosec));
-  centered_laser_pose_.stamp_ = tp;
-  // Get the laser's pose that is centered
-  tf2::Stamped<tf2::Transform> odom_pose;
-  geometry_msgs::msg::TransformStamped odom_pose_msg;
+  tf2::Transform odom_pose;
   try {
-    buffer->transform(
-      tf2::toMsg(centered_laser_pose_),
-      odom_pose_msg,
-      odom_frame_,
-      tf2::durationFromSec(0.4)
-    );
-    tf2::fromMsg(odom_pose_msg, odom_pose);
+    geometry_msgs::msg::TransformStamped base_pose_msg =
+      buffer->lookupTransform(odom_frame_, base_frame_, tp, tf2::durationFromSec(0.0));
+    tf2::Transform base_pose;
+    tf2::fromMsg(base_pose_msg.transform, base_pose);
+    odom_pose = base_pose * centered_laser_to_base_;
   } catch (tf2::TransformException & e) {
     RCLCPP_WARN(this->get_logger(), "Failed to compute odom pose, skipping scan (%s)\n", e.what());
-    std::vector<std::string> frames;
-    frames.push_back("base_scan");
-    frames.push_back("base_link");
-    frames.push_back("base_footprint");
-    frames.push_back("odom");
+    static const char * const frames[] = {"base_scan", "base_link", "base_footprint", "odom"};
 
     /* can't transform odom --> base_scan, try intermediate */
-    for (auto from_frame : frames) {
-      for (auto to_frame : frames) {
+    for (const char * from_frame : frames) {
+      for (const char * to_frame : frames) {
         try {
           geometry_msgs::msg::TransformStamped odom_pose_msg;
           buffer->lookupTransform(from_frame, to_frame, tf2_ros::fromMsg(t));
@@ -367,7 +528,7 @@ SlamGMapping::getOdomPose(GMapping::OrientedPoint & gmap_pose, const auto & t)
 }
 
 bool
-SlamGMapping::initMapper(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan)
+SlamGMapping::initMapper(sensor_msgs::msg::LaserScan::ConstSharedPtr scan)
 {
   laser_frame_ = scan->header.frame_id;
   // Get the laser's pose, relative to base.
@@ -385,7 +546,7 @@ SlamGMapping::initMapper(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan
       tf2::toMsg(ident),
       laser_pose_msg,
       base_frame_,
-      tf2::durationFromSec(0.4)
+      tf2::durationFromSec(0.0)
     );
     tf2::fromMsg(laser_pose_msg, laser_pose);
   } catch (tf2::TransformException & e) {
@@ -418,8 +579,6 @@ SlamGMapping::initMapper(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan
     return false;
   }
 
-  gsp_laser_beam_count_ = scan->ranges.size();
-
   double angle_center = (scan->angle_min + scan->angle_max) / 2;
 
   if (up.point.z > 0) {
@@ -439,6 +598,8 @@ SlamGMapping::initMapper(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan
       tf2::Transform(q, tf2::Vector3(0, 0, 0)), time_stamp, laser_frame_);
     RCLCPP_INFO(this->get_logger(), "Laser is mounted upside down.\n");
   }
+  // The laser is fixed on the base, so getOdomPose() only has to look up base->odom
+  centered_laser_to_base_ = laser_pose * centered_laser_pose_;
 
   // Compute the angles of the laser from -x to x, basically symmetric and in increasing order
   laser_angles_.resize(scan->ranges.size());
@@ -457,12 +618,48 @@ SlamGMapping::initMapper(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan
   RCLCPP_INFO(this->get_logger(), "Laser angles in top-down centered laser-frame: min: %.3f max: %.3f inc: %.3f\n",
     laser_angles_.front(), laser_angles_.back(), std::fabs(scan->angle_increment));
 
+  // With extra lasers GMapping sees a full circle of beams at the scan's increment
+  // around the centered laser, with the scan's own beams in the middle
+  laser_beam_count_ = scan->ranges.size();
+  scan_beam_offset_ = 0;
+  if (!extra_lasers_.empty()) {
+    const double increment = std::fabs(scan->angle_increment);
+    const size_t count = std::max(laser_beam_count_,
+        static_cast<size_t>(std::lround(2 * M_PI / increment)));
+    scan_beam_offset_ = (count - laser_beam_count_) / 2;
+    fused_angle_min_ = laser_angles_.front() - scan_beam_offset_ * increment;
+    fused_angle_increment_ = increment;
+    laser_angles_.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      laser_angles_[i] = fused_angle_min_ + i * increment;
+    }
+    RCLCPP_INFO(this->get_logger(), "Fusing %zu extra lasers into %zu beams\n",
+      extra_lasers_.size(), count);
+  }
+
   GMapping::OrientedPoint gmap_pose(0, 0, 0);
 
   // setting maxRange and maxUrange here so we can set a reasonable default
   maxRange_ = this->declare_parameter("maxRange", scan->range_max - 0.01);
   maxUrange_ = this->declare_parameter("maxUrange", maxRange_);
 
+  // GMapping gets the beams left by the beam filter
+  BeamFilter::Parameters filter;
+  filter.bin_size = beam_bin_size_;
+  filter.drop_unusable = beam_drop_unusable_;
+  filter.usable_range = maxUrange_;
+  filter.feature_threshold = beam_feature_threshold_;
+  filter.max_gap = beam_max_gap_;
+  filter.no_return = scan->range_max;
+  beam_filter_.configure(laser_angles_, filter);
+  scan_ranges_.resize(laser_angles_.size());
+  laser_angles_ = beam_filter_.angles();
+  gsp_laser_beam_count_ = beam_filter_.beamCount();
+  if (gsp_laser_beam_count_ != scan_ranges_.size()) {
+    RCLCPP_INFO(this->get_logger(), "Beam filter bins %zu beams into %u\n",
+      scan_ranges_.size(), gsp_laser_beam_count_);
+  }
+
   // The laser must be called "FLASER".
   // We pass in the absolute value of the computed angle increment, on the
   // assumption that GMapping requires a positive angle increment.  If the
@@ -470,16 +667,30 @@ SlamGMapping::initMapper(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan
   // feeding each scan to GMapping.
   gsp_laser_ = new GMapping::RangeSensor("FLASER",
       gsp_laser_beam_count_,
-      fabs(scan->angle_increment),
+      fabs(scan->angle_increment) * beam_bin_size_,
       gmap_pose,
       0.0,
       maxRange_);
   assert(gsp_laser_);
+  if (beam_bin_size_ > 1 || !extra_lasers_.empty()) {
+    // RangeSensor spaces its beams evenly from -beams * resolution / 2. A partial last bin
+    // is narrower, and the fused circle sits half a beam off that layout when the added
+    // beams do not split evenly around the scan, so the beams take the angles they were
+    // filled at.
+    for (unsigned int i = 0; i < gsp_laser_beam_count_; ++i) {
+      gsp_laser_->beams()[i].pose.theta = laser_angles_[i];
+    }
+    gsp_laser_->updateBeamsLookup();
+  }
 
   GMapping::SensorMap smap;
   smap.insert(make_pair(gsp_laser_->getName(), gsp_laser_));
   gsp_->setSensorMap(smap);
 
+  // Reused for every scan; processScan() copies what it keeps in the trajectory
+  gsp_reading_ = std::make_unique<GMapping::RangeReading>(
+    gsp_laser_beam_count_, std::vector<double>(gsp_laser_beam_count_, 0.0).data(), gsp_laser_);
+
   gsp_odom_ = std::make_unique<GMapping::OdometrySensor>(odom_frame_);
 
   /// @todo Expose setting an initial pose
@@ -491,6 +702,27 @@ SlamGMapping::initMapper(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan
     initialPose = GMapping::OrientedPoint(0.0, 0.0, 0.0);
   }
 
+  Checkpoint checkpoint;
+  if (!resume_from_.empty()) {
+    if (readCheckpoint(resume_from_, checkpoint)) {
+      // Start from the saved map's bounds and pose; the motion since the checkpoint
+      // comes from the odometry
+      const GMapping::ScanMatcherMap & map = *checkpoint.map;
+      const GMapping::Point wmin = map.map2world(GMapping::IntPoint(0, 0));
+      const GMapping::Point wmax =
+        map.map2world(GMapping::IntPoint(map.getMapSizeX(), map.getMapSizeY()));
+      xmin_ = wmin.x; ymin_ = wmin.y;
+      xmax_ = wmax.x; ymax_ = wmax.y;
+      delta_ = map.getDelta();
+      initialPose = checkpoint.pose;
+      RCLCPP_INFO(this->get_logger(), "Resuming from %s at %.3f %.3f %.3f\n",
+        resume_from_.c_str(), initialPose.x, initialPose.y, initialPose.theta);
+    } else {
+      RCLCPP_ERROR(this->get_logger(), "Unable to read checkpoint %s, starting a new map\n",
+        resume_from_.c_str());
+    }
+  }
+
   gsp_->setMatchingParameters(maxUrange_, maxRange_, sigma_,
     kernelSize_, lstep_, astep_, iterations_,
     lsigma_, ogain_, lskip_);
@@ -500,6 +732,12 @@ SlamGMapping::initMapper(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan
   gsp_->setUpdatePeriod(temporalUpdate_);
   gsp_->setgenerateMap(false);
   gsp_->init(particles_, xmin_, ymin_, xmax_, ymax_, delta_, initialPose);
+  if (checkpoint.map) {
+    gsp_->resume(*checkpoint.map, checkpoint.odom_pose);
+    // The map builder's rebuilds start from the saved map. The particles share its
+    // patches, so the builder gets a copy of its own.
+    map_base_ = cloneMap(*checkpoint.map);
+  }
   gsp_->setllsamplerange(llsamplerange_);
   gsp_->setllsamplestep(llsamplestep_);
   /// @todo Check these calls; in the gmapping gui, they use
@@ -509,8 +747,31 @@ SlamGMapping::initMapper(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan
   gsp_->setlasamplestep(lasamplestep_);
   gsp_->setminimumScore(minimum_score_);
 
-  // Call the sampling function once to set the seed.
-  GMapping::sampleGaussian(1, seed_);
+  gsp_->setAdaptiveParticles(adaptive_particles_, min_particles_, max_particles_);
+  gsp_->setKldParameters(kld_err_, kld_z_, kld_xy_bin_size_, kld_theta_bin_size_);
+
+  // Spread the per-particle scan matching over the requested number of threads
+  gsp_->setThreadCount(num_threads_);
+  if (scan_matcher_backend_ == "cuda") {
+    if (!gsp_->setMatcherBackend(ParallelGridSlamProcessor::MatcherBackend::kCuda)) {
+      RCLCPP_WARN(this->get_logger(),
+        "No CUDA device to score scan matching candidates on, or built without "
+        "GMAPPING_CUDA; scoring them on the CPU");
+    }
+  } else if (scan_matcher_backend_ != "cpu") {
+    RCLCPP_WARN(this->get_logger(), "Unknown scan_matcher_backend \"%s\", using \"cpu\"",
+      scan_matcher_backend_.c_str());
+  }
+  gsp_->configureMatchers(*gsp_laser_);
+
+  // The map builder renders with its own matchers and threads, set up once here
+  map_renderer_ = std::make_unique<MapRenderer>(num_threads_);
+  map_renderer_->setLaserParameters(laser_angles_, gsp_laser_->getPose(), maxRange_, maxUrange_);
+
+  // The processor samples from its own streams, so sessions sharing a process
+  // do not share random state; logging the seed lets a run be reproduced
+  gsp_->setSeed(seed_);
+  RCLCPP_INFO(this->get_logger(), "Particle sampling seed: %lu", seed_);
 
   RCLCPP_INFO(this->get_logger(), "Initialization complete\n");
 
@@ -519,50 +780,64 @@ SlamGMapping::initMapper(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan
 
 bool
 SlamGMapping::addScan(
-  const std::shared_ptr<sensor_msgs::msg::LaserScan> scan,
+  sensor_msgs::msg::LaserScan::ConstSharedPtr scan,
   GMapping::OrientedPoint & gmap_pose)
 {
-  if (!getOdomPose(gmap_pose, scan->header.stamp)) {
-    RCLCPP_ERROR(this->get_logger(), "Error: getOdomPose failed!");
-    return false;
+  const size_t allocations_start = allocation_counter::count();
+  {
+    GMAPPING_TIME_STAGE(stage_times_.odom_pose);
+    if (!getOdomPose(gmap_pose, scan->header.stamp)) {
+      RCLCPP_ERROR(this->get_logger(), "Error: getOdomPose failed!");
+      return false;
+    }
   }
 
-  if (scan->ranges.size() != gsp_laser_beam_count_) {
-    RCLCPP_ERROR(this->get_logger(), "Error: scan->ranges.size() != gsp_laser_beam_count_!");
+  if (scan->ranges.size() != laser_beam_count_) {
+    RCLCPP_ERROR(this->get_logger(), "Error: scan->ranges.size() != laser_beam_count_!");
     return false;
   }
 
-  // GMapping wants an array of doubles...
+  // GMapping wants an array of doubles; the beam filter writes them into the
+  // reading allocated in initMapper()
+  const size_t allocations_reading = allocation_counter::count();
+  GMapping::RangeReading & reading = *gsp_reading_;
   size_t num_ranges = scan->ranges.size();
-  double * ranges_double = new double[num_ranges];
+  double * ranges = scan_ranges_.data() + scan_beam_offset_;
   // If the angle increment is negative, we have to invert the order of the readings.
   if (do_reverse_range_) {
     RCLCPP_DEBUG(this->get_logger(), "Inverting scan\n");
     for (size_t i = 0; i < num_ranges; i++) {
       // Must filter out short readings, because the mapper won't
-      ranges_double[i] = (scan->ranges[num_ranges - i - 1] < scan->range_min) ?
+      ranges[i] = (scan->ranges[num_ranges - i - 1] < scan->range_min) ?
         scan->range_max :
         scan->ranges[num_ranges - i - 1];
     }
   } else {
     for (size_t i = 0; i < num_ranges; i++) {
       // Must filter out short readings, because the mapper won't
-      ranges_double[i] = (scan->ranges[i] < scan->range_min) ?
+      ranges[i] = (scan->ranges[i] < scan->range_min) ?
         scan->range_max :
         scan->ranges[i];
     }
   }
+  // TF lookups of the fusion allocate, only filling the reading has to be free of that
+  size_t fusion_allocations = 0;
+  if (!extra_lasers_.empty()) {
+    // Beams outside the scan's field of view only see the extra lasers
+    std::fill(scan_ranges_.begin(), scan_ranges_.begin() + scan_beam_offset_, scan->range_max);
+    std::fill(scan_ranges_.begin() + scan_beam_offset_ + num_ranges, scan_ranges_.end(),
+      scan->range_max);
+    const size_t allocations_fusion = allocation_counter::count();
+    scans_fused_ += fuseExtraScans(scan->header.stamp, gmap_pose);
+    fusion_allocations = allocation_counter::count() - allocations_fusion;
+  }
+  {
+    GMAPPING_TIME_STAGE(stage_times_.beam_filter);
+    beam_filter_.apply(scan_ranges_.data(), reading.data());
+  }
 
   tf2::TimePoint stamp_time = tf2_ros::fromMsg(scan->header.stamp);
-
-  GMapping::RangeReading reading(num_ranges,
-    ranges_double,
-    gsp_laser_,
-    tf2::timeToSec(stamp_time));
-
-  // ...but it deep copies them in RangeReading constructor, so we don't
-  // need to keep our array around.
-  delete[] ranges_double;
+  reading.setTime(tf2::timeToSec(stamp_time));
 
   reading.setPose(gmap_pose);
 
@@ -573,8 +848,64 @@ SlamGMapping::addScan(
     gmap_pose.y,
     gmap_pose.theta);
 
+  const size_t allocations_process = allocation_counter::count();
   RCLCPP_DEBUG(this->get_logger(), "processing scan\n");
-  bool ret = gsp_->processScan(reading);
+  bool ret;
+  const size_t particle_count = gsp_->getParticles().size();
+  const auto process_start = std::chrono::steady_clock::now();
+  {
+    GMAPPING_TIME_STAGE(stage_times_.process_scan);
+    ret = gsp_->processScan(reading);
+  }
+  if (ret) {
+    scans_processed_++;
+    if (adaptive_particles_ && particle_time_budget_ > 0.0) {
+      limitParticles(std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - process_start).count() / particle_count);
+    }
+    if (prune_trajectory_) {
+      const size_t first_pruned = pruned_scans_.size();
+      gsp_->pruneTree(pruned_scans_);
+      // Once the newest rendered node is pruned the chain walk cannot find it any more;
+      // remember which pruned scans came after it so the next update renders only those
+      for (size_t i = first_pruned; !map_cache_pruned_ && i < pruned_scans_.size(); ++i) {
+        const auto & scan = pruned_scans_[i];
+        if (scan.reading.get() == map_cache_node_reading_ &&
+          scan.pose.x == map_cache_node_pose_.x && scan.pose.y == map_cache_node_pose_.y &&
+          scan.pose.theta == map_cache_node_pose_.theta)
+        {
+          map_cache_pruned_ = true;
+          map_cache_pruned_from_ = i + 1;
+          map_cache_node_ = nullptr;
+        }
+      }
+    }
+    {
+      // The readings of released nodes can be reused once no map update refers to them
+      std::lock_guard<std::mutex> update_lock(map_update_mutex_);
+      if (!pending_map_update_ && !map_update_busy_) {
+        gsp_->recycleReadings();
+      }
+    }
+    trajectory_nodes_ = gsp_->trajectoryNodeCount();
+    // Walking every particle's patches is not free, so the usage is sampled
+    if (scans_processed_ % 10 == 1) {
+      limitMapMemory();
+    }
+  }
+  if (allocation_counter::enabled()) {
+    scan_allocations_.odom_pose = allocations_reading - allocations_start;
+    scan_allocations_.reading = allocations_process - allocations_reading - fusion_allocations;
+    scan_allocations_.process_scan = allocation_counter::count() - allocations_process;
+    RCLCPP_DEBUG(this->get_logger(),
+      "heap allocations: odom pose %zu, reading %zu, processScan %zu\n",
+      scan_allocations_.odom_pose, scan_allocations_.reading, scan_allocations_.process_scan);
+    // The reading is preallocated, so filling it must never touch the heap
+    if (scan_allocations_.reading > 0) {
+      RCLCPP_WARN(this->get_logger(), "Filling the scan reading allocated %zu times",
+        scan_allocations_.reading);
+    }
+  }
   if (!ret) {
     /* Is this the value to check? Could it be true? */
     RCLCPP_ERROR(this->get_logger(), "gsp->processScan(reading); failed!");
@@ -583,22 +914,143 @@ SlamGMapping::addScan(
 }
 
 void
-SlamGMapping::laserCallback(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan)
+SlamGMapping::limitParticles(double particle_time)
 {
-  if (!buffer->canTransform(odom_frame_,
-    scan->header.frame_id,
-    tf2_ros::fromMsg(scan->header.stamp),
-    tf2::durationFromSec(0.3)))
-  {
-    return;
+  // Smooth the cost of one particle over the last few scans before turning the
+  // budget into the largest particle set the next resample may produce
+  particle_time_ = particle_time_ > 0.0 ? 0.8 * particle_time_ + 0.2 * particle_time :
+    particle_time;
+  const double affordable = particle_time_budget_ / particle_time_;
+  const int max_particles = static_cast<int>(
+    std::max<double>(min_particles_, std::min<double>(max_particles_, affordable)));
+  gsp_->setAdaptiveParticles(true, min_particles_, max_particles);
+}
+
+void
+SlamGMapping::limitMapMemory()
+{
+  size_t usage = gsp_->mapMemoryUsage();
+  if (map_memory_budget_ > 0.0 && usage > 0.9 * map_memory_budget_) {
+    // Compact what lies well outside the matcher's reach and only bring it back
+    // once it is within reach again, so patches do not flip on every scan
+    gsp_->setCompactRestoreDistance(1.5 * maxRange_);
+    const size_t compacted = gsp_->compactDistantPatches(2.0 * maxRange_);
+    usage = gsp_->mapMemoryUsage();
+    RCLCPP_DEBUG(this->get_logger(), "Compacted %zu map patches, %zu compacted in total\n",
+      compacted, gsp_->compactedPatchCount());
+    if (usage > map_memory_budget_) {
+      RCLCPP_WARN_THROTTLE(this->get_logger(), *this->get_clock(), 5000,
+        "Particle maps use %.1f MB, over the budget of %.1f MB",
+        usage / (1024.0 * 1024.0), map_memory_budget_ / (1024.0 * 1024.0));
+    }
   }
+  map_memory_usage_ = usage;
+}
 
-  laser_count_++;
-  if ((laser_count_ % throttle_scans_) != 0) {
-    return;
+void
+SlamGMapping::laserCallback(sensor_msgs::msg::LaserScan::ConstSharedPtr scan)
+{
+  scans_received_++;
+  scan_queue_.push_back({scan, std::chrono::steady_clock::now(), false});
+  if (scan_queue_.size() > scan_queue_size_) {
+    scan_queue_.pop_front();
+    scans_dropped_++;
+    RCLCPP_WARN_THROTTLE(this->get_logger(), *this->get_clock(), 5000,
+      "Dropped scan waiting for a transform to %s (%zu dropped, %zu delayed so far)",
+      odom_frame_.c_str(), droppedScanCount(), delayedScanCount());
+  }
+  processScanQueue();
+  // Counted as delayed only once it is processed, as it may still be dropped
+  if (!scan_queue_.empty() && scan_queue_.back().scan == scan) {
+    scan_queue_.back().waited = true;
   }
+}
+
+void
+SlamGMapping::processScanQueue()
+{
+  // Scans are released in arrival order and only once odom is available at their
+  // stamp; the zero timeout keeps this from ever blocking the executor
+  while (!scan_queue_.empty() && isScanReady(*scan_queue_.front().scan)) {
+    const QueuedScan queued = scan_queue_.front();
+    scan_queue_.pop_front();
+    // With a latency budget only the freshest ready scan is worth processing
+    if (scan_latency_budget_ > 0.0 && !scan_queue_.empty() &&
+      isScanReady(*scan_queue_.front().scan))
+    {
+      scans_skipped_++;
+      continue;
+    }
+    if (queued.waited) {
+      scans_delayed_++;
+    }
+    GMAPPING_RECORD_STAGE(stage_times_.tf_wait,
+      std::chrono::steady_clock::now() - queued.received);
+    handleScan(queued.scan, queued.received);
+  }
+}
 
-  auto last_map_update = tf2::TimePointZero;
+bool
+SlamGMapping::isScanReady(const sensor_msgs::msg::LaserScan & scan) const
+{
+  return buffer->canTransform(odom_frame_,
+           scan.header.frame_id,
+           tf2_ros::fromMsg(scan.header.stamp),
+           tf2::durationFromSec(0.0));
+}
+
+void
+SlamGMapping::updateScanInterval(double latency)
+{
+  // Back off quickly while over budget and speed up gently once well below it,
+  // so the interval settles just under the budget instead of oscillating around it
+  const double min_interval = 0.01;
+  const double max_interval = 2.0;
+  scan_latency_ = scan_latency_ > 0.0 ? 0.7 * scan_latency_ + 0.3 * latency : latency;
+  double interval = scan_interval_;
+  if (scan_latency_ > scan_latency_budget_) {
+    interval = std::min(max_interval, std::max(interval * 1.5, min_interval));
+  } else if (scan_latency_ < 0.8 * scan_latency_budget_) {
+    interval *= 0.8;
+    if (interval < min_interval) {
+      interval = 0.0;
+    }
+  }
+  scan_interval_ = interval;
+}
+
+size_t
+SlamGMapping::droppedScanCount() const
+{
+  return scans_dropped_;
+}
+
+size_t
+SlamGMapping::delayedScanCount() const
+{
+  return scans_delayed_;
+}
+
+void
+SlamGMapping::handleScan(
+  sensor_msgs::msg::LaserScan::ConstSharedPtr scan,
+  std::chrono::steady_clock::time_point received)
+{
+  tf2::TimePoint stamp_time = tf2_ros::fromMsg(scan->header.stamp);
+  if (scan_latency_budget_ > 0.0) {
+    if (got_first_scan_ &&
+      stamp_time - last_scan_processed_ < tf2::durationFromSec(scan_interval_))
+    {
+      scans_skipped_++;
+      return;
+    }
+  } else {
+    laser_count_++;
+    if ((laser_count_ % throttle_scans_) != 0) {
+      scans_throttled_++;
+      return;
+    }
+  }
 
   // We can't initialize the mapper until we've got the first scan
   if (!got_first_scan_) {
@@ -613,6 +1065,11 @@ SlamGMapping::laserCallback(const std::shared_ptr<sensor_msgs::msg::LaserScan> s
 
   if (addScan(scan, odom_pose)) {
     RCLCPP_DEBUG(this->get_logger(), "scan processed\n");
+    if (scan_latency_budget_ > 0.0) {
+      last_scan_processed_ = stamp_time;
+      updateScanInterval(std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - received).count());
+    }
 
     GMapping::OrientedPoint mpose = gsp_->getParticles()[gsp_->getBestParticleIndex()].pose;
     RCLCPP_DEBUG(this->get_logger(), "new best pose: %.3f %.3f %.3f\n", mpose.x, mpose.y, mpose.theta);
@@ -628,16 +1085,11 @@ SlamGMapping::laserCallback(const std::shared_ptr<sensor_msgs::msg::LaserScan> s
     tf2::Transform odom_to_laser =
       tf2::Transform(odom_q, tf2::Vector3(odom_pose.x, odom_pose.y, 0.0));
 
-    map_to_odom_mutex_.lock();
-    map_to_odom_ = (odom_to_laser * laser_to_map).inverse();
-    map_to_odom_mutex_.unlock();
-
-    tf2::TimePoint stamp_time = tf2_ros::fromMsg(scan->header.stamp);
+    storeMapToOdom((odom_to_laser * laser_to_map).inverse());
 
-    if (!got_map_ || (stamp_time - last_map_update) > map_update_interval_) {
-      updateMap(scan);
-      last_map_update = tf2_ros::fromMsg(scan->header.stamp);
-      RCLCPP_DEBUG(this->get_logger(), "Updated the map\n");
+    if (!got_map_ || (stamp_time - last_map_update_) > map_update_interval_) {
+      scheduleMapUpdate();
+      last_map_update_ = stamp_time;
     }
   } else {
     RCLCPP_DEBUG(this->get_logger(), "cannot process scan\n");
@@ -662,28 +1114,224 @@ SlamGMapping::computePoseEntropy()
 }
 
 void
-SlamGMapping::updateMap(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan)
+SlamGMapping::extraLaserCallback(size_t index, sensor_msgs::msg::LaserScan::ConstSharedPtr scan)
 {
-  RCLCPP_DEBUG(this->get_logger(), "Update map\n");
-  std::lock_guard<std::mutex> map_lock(map_mutex_);
-  GMapping::ScanMatcher matcher;
+  // A few scans are kept so the one closest to the next scan on "scan" can be picked,
+  // whichever arrives first
+  auto & scans = extra_lasers_[index].scans;
+  scans.push_back(scan);
+  if (scans.size() > 4) {
+    scans.pop_front();
+  }
+}
 
-  matcher.setLaserParameters(scan->ranges.size(), &(laser_angles_[0]),
-    gsp_laser_->getPose());
+size_t
+SlamGMapping::fuseExtraScans(
+  const builtin_interfaces::msg::Time & stamp,
+  const GMapping::OrientedPoint & gmap_pose)
+{
+  const tf2::TimePoint scan_time = tf2_ros::fromMsg(stamp);
+  tf2::Quaternion q;
+  q.setRPY(0.0, 0.0, gmap_pose.theta);
+  const tf2::Transform laser_odom_pose(q, tf2::Vector3(gmap_pose.x, gmap_pose.y, 0.0));
+  const long count = static_cast<long>(scan_ranges_.size());
+  size_t fused = 0;
+
+  for (auto & laser : extra_lasers_) {
+    sensor_msgs::msg::LaserScan::ConstSharedPtr extra;
+    double best_difference = scan_sync_tolerance_;
+    for (const auto & candidate : laser.scans) {
+      const double difference = std::fabs(tf2::durationToSec(
+          tf2_ros::fromMsg(candidate->header.stamp) - scan_time));
+      if (difference <= best_difference) {
+        extra = candidate;
+        best_difference = difference;
+      }
+    }
+    if (!extra) {
+      continue;
+    }
 
-  matcher.setlaserMaxRange(maxRange_);
-  matcher.setusableRange(maxUrange_);
-  matcher.setgenerateMap(true);
+    if (!laser.has_mount) {
+      try {
+        tf2::fromMsg(buffer->lookupTransform(base_frame_, extra->header.frame_id,
+          tf2::TimePointZero).transform, laser.laser_to_base);
+        laser.has_mount = true;
+      } catch (tf2::TransformException & e) {
+        RCLCPP_WARN_THROTTLE(this->get_logger(), *this->get_clock(), 5000,
+          "Not fusing %s, unable to find the laser's pose (%s)", laser.topic.c_str(), e.what());
+        continue;
+      }
+    }
+    // The odometry between the two stamps moves the extra scan to the scan's time. An
+    // extra scan newer than the odometry is taken as simultaneous, being within tolerance.
+    tf2::Transform base_pose = laser_odom_pose * centered_laser_to_base_.inverse();
+    try {
+      tf2::fromMsg(buffer->lookupTransform(odom_frame_, base_frame_,
+        tf2_ros::fromMsg(extra->header.stamp), tf2::durationFromSec(0.0)).transform, base_pose);
+    } catch (tf2::TransformException & e) {
+      RCLCPP_DEBUG(this->get_logger(), "No odometry at the %s scan (%s)\n",
+        laser.topic.c_str(), e.what());
+    }
+    const tf2::Transform to_centered_laser =
+      laser_odom_pose.inverse() * base_pose * laser.laser_to_base;
+
+    for (size_t i = 0; i < extra->ranges.size(); ++i) {
+      const double range = extra->ranges[i];
+      // Also false for NaN
+      if (!(range >= extra->range_min && range < extra->range_max)) {
+        continue;
+      }
+      const double angle = extra->angle_min + i * extra->angle_increment;
+      const tf2::Vector3 point =
+        to_centered_laser * tf2::Vector3(range * std::cos(angle), range * std::sin(angle), 0.0);
+      long beam = std::lround(
+        (std::atan2(point.y(), point.x()) - fused_angle_min_) / fused_angle_increment_);
+      beam = ((beam % count) + count) % count;
+      scan_ranges_[beam] = std::min(scan_ranges_[beam], std::hypot(point.x(), point.y()));
+    }
+    fused++;
+  }
+  return fused;
+}
 
-  GMapping::GridSlamProcessor::Particle best =
-    gsp_->getParticles()[gsp_->getBestParticleIndex()];
+void
+SlamGMapping::scheduleMapUpdate()
+{
   std_msgs::msg::Float64 entropy;
   entropy.data = computePoseEntropy();
   if (entropy.data > 0.0) {
     entropy_publisher_->publish(entropy);
   }
 
-  if (!got_map_) {
+  const int best_index = gsp_->getBestParticleIndex();
+  const GMapping::GridSlamProcessor::Particle & best = gsp_->getParticles()[best_index];
+  MapUpdate update;
+
+  // Only the nodes added since the last update have to be rendered, unless the best
+  // particle changed or a resample cut the previously rendered node out of its ancestry.
+  // A pruned cache node is an ancestor of every particle, so then the whole remaining
+  // chain and the scans pruned after the node are new.
+  update.rebuild = !incremental_map_update_ ||
+    (!map_cache_pruned_ && best_index != map_cache_particle_);
+  if (!update.rebuild) {
+    update.rebuild = !map_cache_pruned_;
+    for (auto n = best.node; n; n = n->parent) {
+      if (!map_cache_pruned_ && isCachedNode(n)) {
+        update.rebuild = false;
+        break;
+      }
+      update.nodes.emplace_back(n->pose, n->reading);
+    }
+    if (map_cache_pruned_) {
+      for (size_t i = pruned_scans_.size(); i-- > map_cache_pruned_from_; ) {
+        update.nodes.emplace_back(pruned_scans_[i].pose, pruned_scans_[i].reading.get());
+      }
+    }
+  }
+  map_cache_pruned_ = false;
+
+  if (update.rebuild) {
+    update.nodes.clear();
+    for (auto n = best.node; n; n = n->parent) {
+      update.nodes.emplace_back(n->pose, n->reading);
+    }
+  }
+
+  // The pruned scans are owned by the update from here on; earlier updates may still
+  // refer to their readings, which is fine as updates are rendered in order
+  update.base_scans = std::move(pruned_scans_);
+  pruned_scans_.clear();
+
+  update.pose = best.pose;
+  update.odom_pose = gsp_->odometryPose();
+
+  map_cache_particle_ = best_index;
+  map_cache_node_ = best.node;
+  map_cache_node_pose_ = best.node->pose;
+  map_cache_node_reading_ = best.node->reading;
+
+  {
+    std::lock_guard<std::mutex> update_lock(map_update_mutex_);
+    if (pending_map_update_ && !update.rebuild) {
+      // The worker has not picked up the previous update yet, so render both at once
+      pending_map_update_->nodes.insert(pending_map_update_->nodes.end(),
+        update.nodes.begin(), update.nodes.end());
+      pending_map_update_->pose = update.pose;
+      pending_map_update_->odom_pose = update.odom_pose;
+      std::move(update.base_scans.begin(), update.base_scans.end(),
+        std::back_inserter(pending_map_update_->base_scans));
+    } else {
+      if (pending_map_update_) {
+        // A rebuild supersedes the pending update, but not its scans for the base map
+        update.base_scans.insert(update.base_scans.begin(),
+          std::make_move_iterator(pending_map_update_->base_scans.begin()),
+          std::make_move_iterator(pending_map_update_->base_scans.end()));
+      }
+      pending_map_update_ = std::make_unique<MapUpdate>(std::move(update));
+    }
+  }
+  map_update_cv_.notify_all();
+}
+
+void
+SlamGMapping::mapUpdateLoop()
+{
+  std::unique_lock<std::mutex> update_lock(map_update_mutex_);
+  while (map_thread_running_) {
+    map_update_cv_.wait(update_lock, [this] {
+      return !map_thread_running_ || pending_map_update_;
+    });
+    if (!pending_map_update_) {
+      continue;
+    }
+    std::unique_ptr<MapUpdate> update = std::move(pending_map_update_);
+    map_update_busy_ = true;
+    update_lock.unlock();
+    updateMap(*update);
+    RCLCPP_DEBUG(this->get_logger(), "Updated the map\n");
+    writeCheckpoint(*update);
+    update_lock.lock();
+    map_update_busy_ = false;
+    map_update_cv_.notify_all();
+  }
+}
+
+void
+SlamGMapping::waitForMapUpdates()
+{
+  std::unique_lock<std::mutex> update_lock(map_update_mutex_);
+  map_update_cv_.wait(update_lock, [this] {
+    return !map_thread_running_ || (!pending_map_update_ && !map_update_busy_);
+  });
+}
+
+void
+SlamGMapping::writeCheckpoint(const MapUpdate & update)
+{
+  const auto now = std::chrono::steady_clock::now();
+  if (checkpoint_file_.empty() ||
+    std::chrono::duration<double>(now - last_checkpoint_).count() < checkpoint_interval_)
+  {
+    return;
+  }
+  last_checkpoint_ = now;
+
+  // map_cache_ is only touched by the map builder, so this holds up no scan
+  GMAPPING_TIME_STAGE(stage_times_.checkpoint);
+  if (!::writeCheckpoint(checkpoint_file_, *map_cache_, update.pose, update.odom_pose)) {
+    RCLCPP_WARN(this->get_logger(), "Unable to write checkpoint %s\n", checkpoint_file_.c_str());
+  }
+}
+
+void
+SlamGMapping::updateMap(const MapUpdate & update)
+{
+  RCLCPP_DEBUG(this->get_logger(), "Update map\n");
+
+  const bool first_map = !got_map_;
+  bool resized = false;
+  if (first_map) {
     map_.map.info.resolution = delta_;
     map_.map.info.origin.position.x = 0.0;
     map_.map.info.origin.position.y = 0.0;
@@ -694,80 +1342,402 @@ SlamGMapping::updateMap(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan)
     map_.map.info.origin.orientation.w = 1.0;
   }
 
-  GMapping::Point center;
-  center.x = (xmin_ + xmax_) / 2.0;
-  center.y = (ymin_ + ymax_) / 2.0;
-
-  GMapping::ScanMatcherMap smap(center, xmin_, ymin_, xmax_, ymax_, delta_);
+  {
+    GMAPPING_TIME_STAGE(stage_times_.map_replay);
+    GMapping::Point center;
+    center.x = (xmin_ + xmax_) / 2.0;
+    center.y = (ymin_ + ymax_) / 2.0;
+
+    // The cache already holds the pruned scans, they only have to go into the base map
+    if (!update.base_scans.empty()) {
+      if (!map_base_) {
+        map_base_ = std::make_unique<GMapping::ScanMatcherMap>(
+          center, xmin_, ymin_, xmax_, ymax_, delta_);
+      }
+      MapRenderer::Scans base_scans;
+      for (const auto & scan : update.base_scans) {
+        base_scans.emplace_back(scan.pose, scan.reading.get());
+      }
+      map_renderer_->render(*map_base_, base_scans);
+    }
 
-  RCLCPP_DEBUG(this->get_logger(), "Trajectory tree:\n");
-  for (auto n = best.node; n; n = n->parent) {
-    RCLCPP_DEBUG(this->get_logger(), "  %.3f %.3f %.3f\n",
-      n->pose.x,
-      n->pose.y,
-      n->pose.theta);
-    if (!n->reading) {
-      RCLCPP_DEBUG(this->get_logger(), "Reading is NULL\n");
-      continue;
+    if (update.rebuild || !map_cache_) {
+      RCLCPP_DEBUG(this->get_logger(), "Rebuilding the map from the full trajectory\n");
+      if (map_base_) {
+        // Copies share the base map's patches until they are written to
+        map_cache_ = std::make_unique<GMapping::ScanMatcherMap>(*map_base_);
+        map_cache_->grow(xmin_, ymin_, xmax_, ymax_);
+      } else {
+        map_cache_ = std::make_unique<GMapping::ScanMatcherMap>(
+          center, xmin_, ymin_, xmax_, ymax_, delta_);
+      }
     }
-    matcher.invalidateActiveArea();
-    matcher.computeActiveArea(smap, n->pose, &((*n->reading)[0]));
-    matcher.registerScan(smap, n->pose, &((*n->reading)[0]));
-  }
 
-  // the map may have expanded, so resize ros message as well
-  if (map_.map.info.width != (unsigned int) smap.getMapSizeX() ||
-    map_.map.info.height != (unsigned int) smap.getMapSizeY())
+    RCLCPP_DEBUG(this->get_logger(), "Rendering %zu trajectory nodes\n", update.nodes.size());
+    map_renderer_->render(*map_cache_, update.nodes);
+  }
+  GMapping::ScanMatcherMap & smap = *map_cache_;
+
+  // the map may have expanded
+  // NOTE: The results of ScanMatcherMap::getSize() are different from the parameters given to the constructor
+  //       so we must obtain the bounding box in a different way
+  GMapping::Point wmin = smap.map2world(GMapping::IntPoint(0, 0));
+  GMapping::Point wmax =
+    smap.map2world(GMapping::IntPoint(smap.getMapSizeX(), smap.getMapSizeY()));
+  if (std::fabs(wmin.x - xmin_) > 0.5 * delta_ || std::fabs(wmin.y - ymin_) > 0.5 * delta_ ||
+    std::fabs(wmax.x - xmax_) > 0.5 * delta_ || std::fabs(wmax.y - ymax_) > 0.5 * delta_)
   {
-
-    // NOTE: The results of ScanMatcherMap::getSize() are different from the parameters given to the constructor
-    //       so we must obtain the bounding box in a different way
-    GMapping::Point wmin = smap.map2world(GMapping::IntPoint(0, 0));
-    GMapping::Point wmax =
-      smap.map2world(GMapping::IntPoint(smap.getMapSizeX(), smap.getMapSizeY()));
     xmin_ = wmin.x; ymin_ = wmin.y;
     xmax_ = wmax.x; ymax_ = wmax.y;
 
     RCLCPP_DEBUG(this->get_logger(), "map size is now %dx%d pixels (%f,%f)-(%f, %f)\n",
       smap.getMapSizeX(), smap.getMapSizeY(),
       xmin_, ymin_, xmax_, ymax_);
+  }
 
-    map_.map.info.width = smap.getMapSizeX();
-    map_.map.info.height = smap.getMapSizeY();
-    map_.map.info.origin.position.x = xmin_;
-    map_.map.info.origin.position.y = ymin_;
+  // The message covers the whole map, or with crop_map the part of it observed so far
+  GMapping::IntPoint crop_min(0, 0);
+  GMapping::IntPoint crop_max(smap.getMapSizeX(), smap.getMapSizeY());
+  if (crop_map_) {
+    cropMap(smap, crop_min, crop_max);
+  }
+  const GMapping::Point crop_origin = smap.map2world(crop_min);
+  if (map_.map.info.width != (unsigned int) (crop_max.x - crop_min.x) ||
+    map_.map.info.height != (unsigned int) (crop_max.y - crop_min.y) ||
+    std::fabs(map_.map.info.origin.position.x - crop_origin.x) > 0.5 * delta_ ||
+    std::fabs(map_.map.info.origin.position.y - crop_origin.y) > 0.5 * delta_)
+  {
+    map_.map.info.width = crop_max.x - crop_min.x;
+    map_.map.info.height = crop_max.y - crop_min.y;
+    map_.map.info.origin.position.x = crop_origin.x;
+    map_.map.info.origin.position.y = crop_origin.y;
     map_.map.data.resize(map_.map.info.width * map_.map.info.height);
+    resized = true;
 
     RCLCPP_DEBUG(this->get_logger(), "map origin: (%f, %f)\n", map_.map.info.origin.position.x,
       map_.map.info.origin.position.y);
   }
 
-  int map_size_x = smap.getMapSizeX();
-  int map_size_y = smap.getMapSizeY();
-  for (int x = 0; x < map_size_x; ++x) {
+  // Gather each row into a contiguous buffer so the thresholding runs over
+  // contiguous memory and the message is written in its own row-major order.
+  // Tiles whose cells changed are remembered so only those go out on map_updates.
+  int map_size_x = map_.map.info.width;
+  int map_size_y = map_.map.info.height;
+  const int tiles_x = (map_size_x + map_tile_size_ - 1) / map_tile_size_;
+  const int tiles_y = (map_size_y + map_tile_size_ - 1) / map_tile_size_;
+  map_dirty_tiles_.assign(tiles_x * tiles_y, false);
+  map_row_.resize(map_size_x);
+  map_row_cells_.resize(map_size_x);
+  for (size_t i = 0; i < map_pyramid_.size(); ++i) {
+    nav_msgs::msg::OccupancyGrid & level = map_pyramid_[i];
+    const unsigned int scale = 2u << i;
+    level.info = map_.map.info;
+    level.info.resolution = map_.map.info.resolution * scale;
+    level.info.width = (map_size_x + scale - 1) / scale;
+    level.info.height = (map_size_y + scale - 1) / scale;
+    level.data.resize(level.info.width * level.info.height);
+  }
+  {
+    GMAPPING_TIME_STAGE(stage_times_.map_convert);
     for (int y = 0; y < map_size_y; ++y) {
-      /// @todo Sort out the unknown vs. free vs. obstacle thresholding
-      GMapping::IntPoint p(x, y);
-      double occ = smap.cell(p);
-      assert(occ <= 1.0);
-      if (occ < 0) {
-        map_.map.data[MAP_IDX(map_.map.info.width, x, y)] = -1;
-      } else if (occ > occ_thresh_) {
-        //map_.map.data[MAP_IDX(map_.map.info.width, x, y)] = (int)round(occ*100.0);
-        map_.map.data[MAP_IDX(map_.map.info.width, x, y)] = 100;
-      } else {
-        map_.map.data[MAP_IDX(map_.map.info.width, x, y)] = 0;
+      for (int x = 0; x < map_size_x; ++x) {
+        map_row_[x] = smap.cell(GMapping::IntPoint(crop_min.x + x, crop_min.y + y));
+        assert(map_row_[x] <= 1.0);
+      }
+      thresholdOccupancy(map_row_.data(), map_size_x, occ_thresh_, map_row_cells_.data());
+
+      int8_t * row = &map_.map.data[MAP_IDX(map_.map.info.width, 0, y)];
+      for (int tx = 0; tx < tiles_x; ++tx) {
+        const int x0 = tx * map_tile_size_;
+        const int len = std::min(map_tile_size_, map_size_x - x0);
+        if (std::memcmp(row + x0, map_row_cells_.data() + x0, len) != 0) {
+          std::memcpy(row + x0, map_row_cells_.data() + x0, len);
+          map_dirty_tiles_[(y / map_tile_size_) * tiles_x + tx] = true;
+        }
+      }
+      if (!map_pyramid_.empty()) {
+        foldPyramidRow(0, y, map_row_cells_.data(), map_size_x, map_size_y);
       }
     }
   }
-  got_map_ = true;
 
   //make sure to set the header information on the map
   map_.map.header.stamp = this->now();
   map_.map.header.frame_id = map_frame_;
+  for (auto & level : map_pyramid_) {
+    level.header = map_.map.header;
+  }
+
+  // map_ keeps being updated in place, readers get an immutable copy
+  auto snapshot = std::make_shared<MapSnapshot>();
+  snapshot->map = map_.map;
+  snapshot->levels = map_pyramid_;
+  {
+    std::lock_guard<std::mutex> snapshot_lock(map_snapshot_mutex_);
+    map_snapshot_ = snapshot;
+  }
+  got_map_ = true;
 
-  sst_->publish(map_.map);
-  sstm_->publish(map_.map.info);
+  // Subscribers can only apply tiles to a grid of the same geometry, so a resize
+  // always goes out as a full map
+  const rclcpp::Time stamp(map_.map.header.stamp);
+  if (first_map || resized || map_full_publish_interval_ <= 0.0 ||
+    (stamp - last_full_map_publish_).seconds() >= map_full_publish_interval_)
+  {
+    sst_->publish(map_.map);
+    sstm_->publish(map_.map.info);
+    last_full_map_publish_ = stamp;
+  } else {
+    publishMapTiles(tiles_x, tiles_y);
+  }
+  for (size_t i = 0; i < map_pyramid_.size(); ++i) {
+    map_pyramid_publishers_[i]->publish(map_pyramid_[i]);
+  }
+  if (map_compressed_publisher_) {
+    gmapping_msgs::msg::CompressedOccupancyGrid compressed;
+    compressed.header = map_.map.header;
+    compressed.info = map_.map.info;
+    compressed.format = "rle";
+    encodeRunLength(map_.map.data.data(), map_.map.data.size(), compressed.data);
+    map_compressed_publisher_->publish(compressed);
+  }
+}
+
+void
+SlamGMapping::cropMap(
+  const GMapping::ScanMatcherMap & smap, GMapping::IntPoint & crop_min,
+  GMapping::IntPoint & crop_max) const
+{
+  // Only patches that scans have touched are allocated, so they bound the observed cells
+  using PatchGrid = GMapping::Array2D<GMapping::autoptr<GMapping::Array2D<GMapping::PointAccumulator>>>;
+  const PatchGrid & patches = smap.storage();
+  const int magnitude = smap.storage().getPatchMagnitude();
+  GMapping::IntPoint observed_min(patches.getXSize(), patches.getYSize());
+  GMapping::IntPoint observed_max(-1, -1);
+  for (int x = 0; x < patches.getXSize(); ++x) {
+    for (int y = 0; y < patches.getYSize(); ++y) {
+      if (patches.cell(x, y)) {
+        observed_min.x = std::min(observed_min.x, x);
+        observed_min.y = std::min(observed_min.y, y);
+        observed_max.x = std::max(observed_max.x, x);
+        observed_max.y = std::max(observed_max.y, y);
+      }
+    }
+  }
+  if (observed_max.x < 0) {
+    return;
+  }
+  observed_min.x <<= magnitude;
+  observed_min.y <<= magnitude;
+  observed_max.x = std::min((observed_max.x + 1) << magnitude, crop_max.x);
+  observed_max.y = std::min((observed_max.y + 1) << magnitude, crop_max.y);
+
+  // Keep the published crop while it holds everything observed, so map_updates can
+  // go on; once it does not, grow it with a tile of margin on every side
+  if (map_.map.info.width > 0) {
+    const GMapping::IntPoint current_min = smap.world2map(
+      map_.map.info.origin.position.x, map_.map.info.origin.position.y);
+    const GMapping::IntPoint current_max(
+      current_min.x + static_cast<int>(map_.map.info.width),
+      current_min.y + static_cast<int>(map_.map.info.height));
+    if (current_min.x >= 0 && current_min.y >= 0 &&
+      current_max.x <= crop_max.x && current_max.y <= crop_max.y &&
+      current_min.x <= observed_min.x && current_min.y <= observed_min.y &&
+      current_max.x >= observed_max.x && current_max.y >= observed_max.y)
+    {
+      crop_min = current_min;
+      crop_max = current_max;
+      return;
+    }
+  }
+  crop_min.x = std::max(0, observed_min.x - map_tile_size_);
+  crop_min.y = std::max(0, observed_min.y - map_tile_size_);
+  crop_max.x = std::min(crop_max.x, observed_max.x + map_tile_size_);
+  crop_max.y = std::min(crop_max.y, observed_max.y + map_tile_size_);
+}
+
+void
+SlamGMapping::foldPyramidRow(size_t index, int y, const int8_t * row, int width, int height)
+{
+  nav_msgs::msg::OccupancyGrid & level = map_pyramid_[index];
+  int8_t * out = &level.data[MAP_IDX(level.info.width, 0, y / 2)];
+  if (y % 2 == 0) {
+    std::fill(out, out + level.info.width, -1);
+  }
+  downsampleOccupancy(row, width, out);
+  // Each finished row is folded into the next coarser level right away, so the
+  // whole pyramid is built in the one pass over the map
+  if ((y % 2 == 1 || y + 1 == height) && index + 1 < map_pyramid_.size()) {
+    foldPyramidRow(index + 1, y / 2, out, level.info.width, level.info.height);
+  }
+}
+
+void
+SlamGMapping::publishMapTiles(int tiles_x, int tiles_y)
+{
+  const int map_size_x = map_.map.info.width;
+  const int map_size_y = map_.map.info.height;
+  map_msgs::msg::OccupancyGridUpdate tile;
+  tile.header = map_.map.header;
+  for (int ty = 0; ty < tiles_y; ++ty) {
+    for (int tx = 0; tx < tiles_x; ++tx) {
+      if (!map_dirty_tiles_[ty * tiles_x + tx]) {
+        continue;
+      }
+      tile.x = tx * map_tile_size_;
+      tile.y = ty * map_tile_size_;
+      tile.width = std::min(map_tile_size_, map_size_x - tile.x);
+      tile.height = std::min(map_tile_size_, map_size_y - tile.y);
+      tile.data.resize(tile.width * tile.height);
+      for (unsigned int y = 0; y < tile.height; ++y) {
+        std::memcpy(&tile.data[y * tile.width],
+          &map_.map.data[MAP_IDX(map_.map.info.width, tile.x, tile.y + y)], tile.width);
+      }
+      sstu_->publish(tile);
+    }
+  }
+}
+
+bool
+SlamGMapping::isCachedNode(const GMapping::GridSlamProcessor::TNode * node) const
+{
+  // The cached pointer may dangle once its branch was resampled away, so a hit on the
+  // address alone is not enough; a recycled node will not carry the same pose and reading.
+  return node == map_cache_node_ &&
+         node->reading == map_cache_node_reading_ &&
+         node->pose.x == map_cache_node_pose_.x &&
+         node->pose.y == map_cache_node_pose_.y &&
+         node->pose.theta == map_cache_node_pose_.theta;
+}
+
+void
+SlamGMapping::publishDiagnostics()
+{
+  diagnostic_msgs::msg::DiagnosticArray diagnostics;
+  diagnostics.header.stamp = this->now();
+  diagnostic_msgs::msg::DiagnosticStatus status;
+  status.name = std::string(this->get_name()) + ": scan pipeline";
+  auto add_value = [&status](const std::string & key, const std::string & value) {
+      diagnostic_msgs::msg::KeyValue key_value;
+      key_value.key = key;
+      key_value.value = value;
+      status.values.push_back(key_value);
+    };
+
+  const size_t dropped = droppedScanCount();
+  char value[32];
+  add_value("scans received", std::to_string(scans_received_));
+  add_value("scans processed", std::to_string(scans_processed_));
+  add_value("scans throttled", std::to_string(scans_throttled_));
+  add_value("scans skipped", std::to_string(scans_skipped_));
+  add_value("scans delayed", std::to_string(delayedScanCount()));
+  add_value("scans dropped", std::to_string(dropped));
+  add_value("extra scans fused", std::to_string(scans_fused_));
+
+  snprintf(value, sizeof(value), "%.3f", scan_interval_.load());
+  add_value("scan interval [s]", value);
+  add_value("trajectory nodes", std::to_string(trajectory_nodes_));
+  snprintf(value, sizeof(value), "%.1f", map_memory_usage_ / (1024.0 * 1024.0));
+  add_value("map memory [MB]", value);
+
+  const std::pair<const char *, StageHistogram *> stages[] = {
+    {"tf wait", &stage_times_.tf_wait},
+    {"odom pose", &stage_times_.odom_pose},
+    {"beam filter", &stage_times_.beam_filter},
+    {"process scan", &stage_times_.process_scan},
+    {"map replay", &stage_times_.map_replay},
+    {"map convert", &stage_times_.map_convert},
+    {"checkpoint", &stage_times_.checkpoint},
+  };
+  for (const auto & stage : stages) {
+    const StageHistogram::Summary summary = stage.second->takeSummary();
+    const std::string name = stage.first;
+    add_value(name + " count", std::to_string(summary.count));
+    snprintf(value, sizeof(value), "%.3f", summary.p50);
+    add_value(name + " p50 [ms]", value);
+    snprintf(value, sizeof(value), "%.3f", summary.p90);
+    add_value(name + " p90 [ms]", value);
+    snprintf(value, sizeof(value), "%.3f", summary.p99);
+    add_value(name + " p99 [ms]", value);
+    snprintf(value, sizeof(value), "%.3f", summary.max);
+    add_value(name + " max [ms]", value);
+  }
+
+  if (dropped > diagnostics_dropped_scans_) {
+    status.level = diagnostic_msgs::msg::DiagnosticStatus::WARN;
+    status.message = "Dropping scans waiting for " + odom_frame_;
+  } else {
+    status.level = diagnostic_msgs::msg::DiagnosticStatus::OK;
+    status.message = "OK";
+  }
+  diagnostics_dropped_scans_ = dropped;
+  diagnostics.status.push_back(status);
+  diagnostics_publisher_->publish(diagnostics);
+}
+
+std::shared_ptr<const SlamGMapping::MapSnapshot>
+SlamGMapping::mapSnapshot()
+{
+  std::lock_guard<std::mutex> snapshot_lock(map_snapshot_mutex_);
+  return map_snapshot_;
+}
+
+bool
+SlamGMapping::saveMap(const std::string & path_base)
+{
+  const auto snapshot = mapSnapshot();
+  if (!snapshot || !snapshot->map.info.width || !snapshot->map.info.height) {
+    return false;
+  }
+  const nav_msgs::msg::MapMetaData & info = snapshot->map.info;
+
+  // Same layout as map_server's map_saver: a PGM image and its YAML description
+  const std::string image_name = path_base + ".pgm";
+  std::ofstream image(image_name, std::ios::binary);
+  if (!image) {
+    RCLCPP_ERROR(this->get_logger(), "Could not open %s for writing", image_name.c_str());
+    return false;
+  }
+  image << "P5\n# CREATOR: slam_gmapping " << info.resolution << " m/pix\n" <<
+    info.width << " " << info.height << "\n255\n";
+  std::vector<char> row(info.width);
+  for (unsigned int y = 0; y < info.height; y++) {
+    const int8_t * cells = &snapshot->map.data[MAP_IDX(info.width, 0, info.height - y - 1)];
+    for (unsigned int x = 0; x < info.width; x++) {
+      row[x] = cells[x] == 0 ? static_cast<char>(254) :
+        cells[x] == 100 ? static_cast<char>(0) : static_cast<char>(205);
+    }
+    image.write(row.data(), row.size());
+  }
+
+  const size_t slash = image_name.find_last_of('/');
+  std::ofstream yaml(path_base + ".yaml");
+  yaml << "image: " << (slash == std::string::npos ? image_name : image_name.substr(slash + 1)) <<
+    "\nresolution: " << info.resolution <<
+    "\norigin: [" << info.origin.position.x << ", " << info.origin.position.y << ", 0.0]" <<
+    "\nnegate: 0\noccupied_thresh: 0.65\nfree_thresh: 0.196\n";
+  return image.good() && yaml.good();
+}
+
+bool
+SlamGMapping::mapLevelCallback(
+  const std::shared_ptr<gmapping_msgs::srv::GetMapLevel::Request> req,
+  std::shared_ptr<gmapping_msgs::srv::GetMapLevel::Response> res)
+{
+  const auto snapshot = mapSnapshot();
+  if (req == nullptr || !snapshot || !snapshot->map.info.width || !snapshot->map.info.height) {
+    return false;
+  }
+  const nav_msgs::msg::OccupancyGrid * map = &snapshot->map;
+  for (const auto & level : snapshot->levels) {
+    // resolution is a float32 in the message, allow for its rounding
+    if (level.info.resolution > req->resolution * (1.0 + 1e-6)) {
+      break;
+    }
+    map = &level;
+  }
+  res->map = *map;
+  return true;
 }
 
 bool
@@ -775,23 +1745,60 @@ SlamGMapping::mapCallback(
   const std::shared_ptr<nav_msgs::srv::GetMap::Request> req,
   std::shared_ptr<nav_msgs::srv::GetMap::Response> res)
 {
-  std::lock_guard<std::mutex> map_lock(map_mutex_);
-  if (req != nullptr && got_map_ && map_.map.info.width && map_.map.info.height) {
-    *res = map_;
+  // The copy into the response no longer holds up the map builder
+  const auto snapshot = mapSnapshot();
+  if (req != nullptr && snapshot && snapshot->map.info.width && snapshot->map.info.height) {
+    res->map = snapshot->map;
     return true;
   }
   return false;
 }
 
+void SlamGMapping::storeMapToOdom(const tf2::Transform & map_to_odom)
+{
+  const tf2::Vector3 & origin = map_to_odom.getOrigin();
+  const tf2::Quaternion rotation = map_to_odom.getRotation();
+  map_to_odom_.store({{origin.x(), origin.y(), origin.z(),
+      rotation.x(), rotation.y(), rotation.z(), rotation.w()}});
+}
+
+tf2::Transform SlamGMapping::loadMapToOdom() const
+{
+  const std::array<double, 7> t = map_to_odom_.load();
+  return tf2::Transform(tf2::Quaternion(t[3], t[4], t[5], t[6]), tf2::Vector3(t[0], t[1], t[2]));
+}
+
+void SlamGMapping::odomCallback(nav_msgs::msg::Odometry::ConstSharedPtr odom)
+{
+  if (odom->header.frame_id != odom_frame_) {
+    RCLCPP_WARN_THROTTLE(this->get_logger(), *this->get_clock(), 5000,
+      "Ignoring odometry in %s, expected %s", odom->header.frame_id.c_str(), odom_frame_.c_str());
+    return;
+  }
+  tf2::Transform odom_pose;
+  tf2::fromMsg(odom->pose.pose, odom_pose);
+
+  // Keeps the odometry's stamp, child frame, covariance and twist; the twist is in the
+  // child frame, which the correction does not change
+  nav_msgs::msg::Odometry map_pose = *odom;
+  map_pose.header.frame_id = map_frame_;
+  tf2::toMsg(loadMapToOdom() * odom_pose, map_pose.pose.pose);
+  map_pose_publisher_->publish(map_pose);
+}
+
 void SlamGMapping::publishTransform()
 {
-  map_to_odom_mutex_.lock();
+  // Never waits for the scan thread, which may be storing a new correction meanwhile
+  const tf2::Transform map_to_odom = loadMapToOdom();
   auto tf_expiration = tf2_ros::fromMsg(this->now()) + tf2::durationFromSec(tf_delay_);
   geometry_msgs::msg::TransformStamped tmp_tf_stamped;
   tmp_tf_stamped.header.frame_id = map_frame_;
   tmp_tf_stamped.child_frame_id = odom_frame_;
   tmp_tf_stamped.header.stamp = tf2_ros::toMsg(tf_expiration);
-  tmp_tf_stamped.transform = tf2::toMsg(map_to_odom_);
+  tmp_tf_stamped.transform = tf2::toMsg(map_to_odom);
   tfB_->sendTransform(tmp_tf_stamped);
-  map_to_odom_mutex_.unlock();
 }
+
+#include <rclcpp_components/register_node_macro.hpp>
+
+RCLCPP_COMPONENTS_REGISTER_NODE(SlamGMapping)
@@ -24,6 +24,12 @@
 #include <rclcpp/time_source.hpp>
 #include <rcutils/cmdline_parser.h>
 #include <rcutils/logging_macros.h>
+#include <rclcpp/serialization.hpp>
+
+/* rosbag2 */
+#include <rosbag2_cpp/converter_options.hpp>
+#include <rosbag2_cpp/readers/sequential_reader.hpp>
+#include <rosbag2_cpp/storage_options.hpp>
 
 /* sensor messages */
 #include <sensor_msgs/msg/laser_scan.hpp>
@@ -33,17 +39,22 @@
 
 /* navigation messages and services */
 #include <nav_msgs/msg/map_meta_data.hpp>
+#include <nav_msgs/msg/odometry.hpp>
 #include <nav_msgs/srv/get_map.hpp>
+#include <map_msgs/msg/occupancy_grid_update.hpp>
+#include <gmapping_msgs/msg/compressed_occupancy_grid.hpp>
+#include <gmapping_msgs/srv/get_map_level.hpp>
+
+/* diagnostic messages */
+#include <diagnostic_msgs/msg/diagnostic_array.hpp>
 
 /* tf2_ros */
 #include <tf2_ros/transform_broadcaster.h>
 #include <tf2_ros/transform_listener.h>
 #include <tf2_ros/buffer.h>
 #include <tf2/utils.h>
-
-/* ??? */
-/* #include <tf2_ros/message_filter.h> */
-/* #include "message_filters/subscriber.h" */
+#include <tf2_msgs/msg/tf_message.hpp>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 
 /* OpenSLAM GMapping */
 #include <gmapping/sensor/sensor_odometry/odometrysensor.h>
@@ -51,70 +62,278 @@
 #include <gmapping/sensor/sensor_base/sensor.h>
 #include <gmapping/gridfastslam/gridslamprocessor.h>
 
+#include "allocation_counter.hpp"
+#include "map_codec.hpp"
+#include "map_renderer.hpp"
+#include "occupancy_kernel.hpp"
+#include "parallel_grid_slam_processor.hpp"
+#include "beam_filter.hpp"
+#include "checkpoint.hpp"
+#include "seqlock.hpp"
+#include "stage_statistics.hpp"
+
 /* STL includes */
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <condition_variable>
+#include <deque>
 #include <memory>
 #include <thread>
 #include <mutex>
 #include <ctime>
+#include <utility>
+#include <vector>
 
 class SlamGMapping : public rclcpp::Node
 {
 public:
   explicit SlamGMapping(const rclcpp::NodeOptions & options = rclcpp::NodeOptions());
+  // Without live_slam the node neither listens to TF nor subscribes to scans, it is
+  // fed by startReplay() instead
+  SlamGMapping(const rclcpp::NodeOptions & options, bool live_slam);
   /* SlamGMapping(ros::NodeHandle& nh, ros::NodeHandle& pnh); */
   /* SlamGMapping(unsigned long int seed, unsigned long int max_duration_buffer); */
   ~SlamGMapping() override;
 
   void init();
   void startLiveSlam();
-  void startReplay(const std::string & bag_fname, std::string scan_topic);
+  // Maps a rosbag2 recording as fast as possible; returns the number of scans read
+  // once the final map is published
+  size_t startReplay(const std::string & bag_fname, std::string scan_topic);
   void publishTransform();
+  void odomCallback(nav_msgs::msg::Odometry::ConstSharedPtr odom);
 
-  void laserCallback(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan);
+  void laserCallback(sensor_msgs::msg::LaserScan::ConstSharedPtr scan);
+  void extraLaserCallback(size_t index, sensor_msgs::msg::LaserScan::ConstSharedPtr scan);
+  // Scans pushed out of the full queue before their transform arrived
+  size_t droppedScanCount() const;
+  // Scans processed after waiting in the queue; a scan that waited and was then dropped
+  // only counts as dropped
+  size_t delayedScanCount() const;
   bool mapCallback(const std::shared_ptr<nav_msgs::srv::GetMap::Request> req,
                    std::shared_ptr<nav_msgs::srv::GetMap::Response> res);
+  bool mapLevelCallback(
+    const std::shared_ptr<gmapping_msgs::srv::GetMapLevel::Request> req,
+    std::shared_ptr<gmapping_msgs::srv::GetMapLevel::Response> res);
   void publishLoop(double transform_publish_period);
+  // Writes the latest map as <path_base>.pgm and <path_base>.yaml for map_server
+  bool saveMap(const std::string & path_base);
 
 private:
+  friend struct SlamGMappingBenchmark;
+  friend struct SlamGMappingTest;
+
+  // Snapshot of the best particle's trajectory, handed from the scan callback to the map builder
+  struct MapUpdate
+  {
+    // Start over with an empty map instead of adding to the previous one
+    bool rebuild = false;
+    MapRenderer::Scans nodes;
+    // Scans pruned from the trajectory tree since the last update, for the base map
+    std::vector<ParallelGridSlamProcessor::PrunedScan> base_scans;
+    // Pose of the best particle and the odometry at its last scan, for the checkpoint
+    GMapping::OrientedPoint pose;
+    GMapping::OrientedPoint odom_pose;
+  };
+
+  // The latest map as published, shared with the services
+  struct MapSnapshot
+  {
+    nav_msgs::msg::OccupancyGrid map;
+    std::vector<nav_msgs::msg::OccupancyGrid> levels;
+  };
+
+  // A laser whose scans are fused into the ones on "scan"
+  struct ExtraLaser
+  {
+    std::string topic;
+    rclcpp::Subscription<sensor_msgs::msg::LaserScan>::SharedPtr subscription;
+    // Latest scans, oldest first
+    std::deque<sensor_msgs::msg::LaserScan::ConstSharedPtr> scans;
+    // The laser's pose in the base frame, looked up with its first fused scan
+    bool has_mount = false;
+    tf2::Transform laser_to_base;
+  };
+
+  struct QueuedScan
+  {
+    sensor_msgs::msg::LaserScan::ConstSharedPtr scan;
+    std::chrono::steady_clock::time_point received;
+    // Still queued after the callback it arrived in
+    bool waited;
+  };
+
+  // Latency of each pipeline stage since the last diagnostics message
+  struct StageTimes
+  {
+    StageHistogram tf_wait;
+    StageHistogram odom_pose;
+    StageHistogram beam_filter;
+    StageHistogram process_scan;
+    StageHistogram map_replay;
+    StageHistogram map_convert;
+    StageHistogram checkpoint;
+  };
+
   rclcpp::Publisher<std_msgs::msg::Float64>::SharedPtr entropy_publisher_;
   rclcpp::Publisher<nav_msgs::msg::OccupancyGrid>::SharedPtr sst_;
   rclcpp::Publisher<nav_msgs::msg::MapMetaData>::SharedPtr sstm_;
+  // Odometry moved into the map frame with the latest correction, at odometry rate
+  rclcpp::Subscription<nav_msgs::msg::Odometry>::SharedPtr odom_sub_;
+  rclcpp::Publisher<nav_msgs::msg::Odometry>::SharedPtr map_pose_publisher_;
+  bool publish_map_pose_;
+  std::string odom_topic_;
+  rclcpp::Publisher<map_msgs::msg::OccupancyGridUpdate>::SharedPtr sstu_;
+  rclcpp::Publisher<diagnostic_msgs::msg::DiagnosticArray>::SharedPtr diagnostics_publisher_;
   rclcpp::Service<nav_msgs::srv::GetMap>::SharedPtr ss_;
+  rclcpp::Service<gmapping_msgs::srv::GetMapLevel>::SharedPtr ss_level_;
+  std::vector<rclcpp::Publisher<nav_msgs::msg::OccupancyGrid>::SharedPtr> map_pyramid_publishers_;
+  rclcpp::Publisher<gmapping_msgs::msg::CompressedOccupancyGrid>::SharedPtr
+    map_compressed_publisher_;
+  rclcpp::CallbackGroup::SharedPtr scan_callback_group_;
+  rclcpp::CallbackGroup::SharedPtr transform_callback_group_;
+  rclcpp::CallbackGroup::SharedPtr map_callback_group_;
   std::unique_ptr<tf2_ros::Buffer> buffer = nullptr;
   std::unique_ptr<tf2_ros::TransformListener> tf_ = nullptr;
-  /* message_filters::Subscriber<sensor_msgs::LaserScan>* scan_filter_sub_; */
   rclcpp::Subscription<sensor_msgs::msg::LaserScan>::SharedPtr scan_filter_sub_;
   rclcpp::Node::SharedPtr tf_node_;
-  /* tf2_ros::MessageFilter<sensor_msgs::msg::LaserScan> * scan_filter_; */
+  std::vector<ExtraLaser> extra_lasers_;
+  // Largest stamp difference between a scan and the extra scans fused into it [s]
+  double scan_sync_tolerance_;
+  std::atomic<size_t> scans_fused_{0};
+  // Scans waiting for the odom transform at their stamp, oldest first
+  std::deque<QueuedScan> scan_queue_;
+  size_t scan_queue_size_;
+  rclcpp::TimerBase::SharedPtr scan_queue_timer_;
+  std::atomic<size_t> scans_dropped_{0};
+  std::atomic<size_t> scans_delayed_{0};
+  std::atomic<size_t> scans_received_{0};
+  std::atomic<size_t> scans_throttled_{0};
+  std::atomic<size_t> scans_processed_{0};
+  // Scans left out by the latency budget scheduler
+  std::atomic<size_t> scans_skipped_{0};
+  StageTimes stage_times_;
+  // Bytes held by the particle maps when last measured
+  std::atomic<size_t> map_memory_usage_{0};
+  // Heap allocations of the last addScan() by stage, with GMAPPING_COUNT_ALLOCATIONS
+  struct ScanAllocations
+  {
+    size_t odom_pose = 0;
+    // Filling the reading, without the TF lookups of extra laser fusion
+    size_t reading = 0;
+    size_t process_scan = 0;
+  };
+  ScanAllocations scan_allocations_;
+  double diagnostics_period_;
+  rclcpp::TimerBase::SharedPtr diagnostics_timer_;
+  size_t diagnostics_dropped_scans_ = 0;
   std::unique_ptr<tf2_ros::TransformBroadcaster> tfB_ = nullptr;
 
-  GMapping::GridSlamProcessor* gsp_ = nullptr;
+  ParallelGridSlamProcessor* gsp_ = nullptr;
   GMapping::RangeSensor* gsp_laser_ = nullptr;
   // The angles in the laser, going from -x to x (adjustment is made to get the laser between
   // symmetrical bounds as that's what gmapping expects)
   std::vector<double> laser_angles_;
   // The pose, in the original laser frame, of the corresponding centered laser with z facing up
   tf2::Stamped<tf2::Transform> centered_laser_pose_;
+  // The centered laser pose in the base frame, looked up once in initMapper()
+  tf2::Transform centered_laser_to_base_;
   // Depending on the order of the elements in the scan and the orientation of the scan frame,
   // We might need to change the order of the scan
   bool do_reverse_range_;
+  // Number of beams handed to GMapping, after the beam filter
   unsigned int gsp_laser_beam_count_;
+  // Ranges of the latest scan in GMapping's beam order, before the beam filter. With
+  // extra lasers they cover the full circle around the laser and the scan's own beams
+  // start at scan_beam_offset_.
+  std::vector<double> scan_ranges_;
+  size_t laser_beam_count_ = 0;
+  size_t scan_beam_offset_ = 0;
+  double fused_angle_min_ = 0.0;
+  double fused_angle_increment_ = 0.0;
+  BeamFilter beam_filter_;
+  // Reading handed to processScan(), sized and allocated once in initMapper()
+  std::unique_ptr<GMapping::RangeReading> gsp_reading_ = nullptr;
   std::unique_ptr<GMapping::OdometrySensor> gsp_odom_ = nullptr;
 
   bool got_first_scan_ = false;
-  bool got_map_ = false;
+  std::atomic<bool> got_map_{false};
 
+  // Only touched by the map builder
   nav_msgs::srv::GetMap::Response map_;
+  std::shared_ptr<const MapSnapshot> map_snapshot_ = nullptr;
+  std::mutex map_snapshot_mutex_;
+  bool publish_compressed_map_;
+
+  // Map of the best particle kept between updates, so only new trajectory nodes get rendered
+  std::unique_ptr<GMapping::ScanMatcherMap> map_cache_ = nullptr;
+  // Renders map_cache_ and map_base_, configured in initMapper()
+  std::unique_ptr<MapRenderer> map_renderer_ = nullptr;
+  // The particle and the newest trajectory node already handed to the map builder
+  int map_cache_particle_ = -1;
+  const GMapping::GridSlamProcessor::TNode * map_cache_node_ = nullptr;
+  GMapping::OrientedPoint map_cache_node_pose_;
+  const GMapping::RangeReading * map_cache_node_reading_ = nullptr;
+  // The newest rendered node was pruned: every particle descends from what the cache holds,
+  // and pruned_scans_ from map_cache_pruned_from_ on are not in it yet
+  bool map_cache_pruned_ = false;
+  size_t map_cache_pruned_from_ = 0;
+  bool incremental_map_update_;
+  bool prune_trajectory_;
+  // Scans pruned from the tree that no map update has taken yet
+  std::vector<ParallelGridSlamProcessor::PrunedScan> pruned_scans_;
+  // Map of the pruned scans, the starting point of every rebuild
+  std::unique_ptr<GMapping::ScanMatcherMap> map_base_ = nullptr;
+  std::atomic<size_t> trajectory_nodes_{0};
+  // Occupancy of one map row, gathered before thresholding it into map_
+  std::vector<double> map_row_;
+  std::vector<int8_t> map_row_cells_;
+  // map_ downsampled by 2, 4, 8, ...
+  std::vector<nav_msgs::msg::OccupancyGrid> map_pyramid_;
+  // Tiles of map_ that changed in the last update, row-major
+  std::vector<bool> map_dirty_tiles_;
+  int map_tile_size_;
+  bool crop_map_;
+  double map_full_publish_interval_;
+  rclcpp::Time last_full_map_publish_{0, 0, RCL_ROS_TIME};
+
+  // The map builder saves the session here every checkpoint_interval_ [s]
+  std::string checkpoint_file_;
+  double checkpoint_interval_;
+  std::chrono::steady_clock::time_point last_checkpoint_;
+  // Checkpoint the first scan continues from
+  std::string resume_from_;
 
   tf2::Duration map_update_interval_;
-  tf2::Transform map_to_odom_;
-  std::mutex map_to_odom_mutex_;
-  std::mutex map_mutex_;
+  tf2::TimePoint last_map_update_ = tf2::TimePointZero;
+
+  // The map builder renders and publishes the map off the scan callback
+  std::thread map_thread_;
+  std::mutex map_update_mutex_;
+  std::condition_variable map_update_cv_;
+  std::unique_ptr<MapUpdate> pending_map_update_ = nullptr;
+  bool map_thread_running_ = false;
+  bool map_update_busy_ = false;
+  // Translation and rotation quaternion, written by the scan thread only
+  SeqLock<std::array<double, 7>> map_to_odom_;
 
   unsigned int laser_count_ = 0;
   unsigned int throttle_scans_;
+  double scan_latency_budget_;
+  // Smoothed time from receiving a scan until it was processed [s]
+  double scan_latency_ = 0.0;
+  // Minimum time between the stamps of two processed scans [s]
+  std::atomic<double> scan_interval_{0.0};
+  tf2::TimePoint last_scan_processed_ = tf2::TimePointZero;
 
   rclcpp::TimerBase::SharedPtr m_timer;
 
@@ -123,10 +342,42 @@ private:
   std::string map_frame_;
   std::string odom_frame_;
 
-  void updateMap(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan);
+  void advertise();
+  void processScanQueue();
+  void limitParticles(double particle_time);
+  // Compacts distant map patches when the particle maps approach map_memory_budget_
+  void limitMapMemory();
+  void publishDiagnostics();
+  bool isScanReady(const sensor_msgs::msg::LaserScan & scan) const;
+  void handleScan(
+    sensor_msgs::msg::LaserScan::ConstSharedPtr scan,
+    std::chrono::steady_clock::time_point received);
+  // Adapts scan_interval_ to the latency of the last processed scan [s]
+  void updateScanInterval(double latency);
+  void storeMapToOdom(const tf2::Transform & map_to_odom);
+  tf2::Transform loadMapToOdom() const;
+  void scheduleMapUpdate();
+  void mapUpdateLoop();
+  // Blocks until the map builder has published every scheduled update
+  void waitForMapUpdates();
+  void updateMap(const MapUpdate & update);
+  void writeCheckpoint(const MapUpdate & update);
+  void publishMapTiles(int tiles_x, int tiles_y);
+  // Narrows [crop_min, crop_max) from the whole of smap to the cells observed so far
+  void cropMap(
+    const GMapping::ScanMatcherMap & smap, GMapping::IntPoint & crop_min,
+    GMapping::IntPoint & crop_max) const;
+  std::shared_ptr<const MapSnapshot> mapSnapshot();
+  // Folds row y of the level above (the full map for index 0) into map_pyramid_[index]
+  void foldPyramidRow(size_t index, int y, const int8_t * row, int width, int height);
+  bool isCachedNode(const GMapping::GridSlamProcessor::TNode * node) const;
   bool getOdomPose(GMapping::OrientedPoint& gmap_pose, const auto & t);
-  bool initMapper(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan);
-  bool addScan(const std::shared_ptr<sensor_msgs::msg::LaserScan> scan, GMapping::OrientedPoint & gmap_pose);
+  bool initMapper(sensor_msgs::msg::LaserScan::ConstSharedPtr scan);
+  bool addScan(sensor_msgs::msg::LaserScan::ConstSharedPtr scan, GMapping::OrientedPoint & gmap_pose);
+  // Projects the extra scans closest to stamp into scan_ranges_, keeping the shorter
+  // range of every beam; returns the number of scans fused
+  size_t fuseExtraScans(const builtin_interfaces::msg::Time & stamp,
+    const GMapping::OrientedPoint & gmap_pose);
   double computePoseEntropy();
 
   // Parameters used by GMapping
@@ -142,6 +393,10 @@ private:
   double lsigma_;
   double ogain_;
   int lskip_;
+  int beam_bin_size_;
+  bool beam_drop_unusable_;
+  double beam_feature_threshold_;
+  int beam_max_gap_;
   double srr_;
   double srt_;
   double str_;
@@ -151,6 +406,21 @@ private:
   double temporalUpdate_;
   double resampleThreshold_;
   int particles_;
+  bool adaptive_particles_;
+  int min_particles_;
+  int max_particles_;
+  double kld_err_;
+  double kld_z_;
+  double kld_xy_bin_size_;
+  double kld_theta_bin_size_;
+  double particle_time_budget_;
+  // [bytes]
+  double map_memory_budget_;
+  // Smoothed processScan() time per particle [s]
+  double particle_time_ = 0.0;
+  int num_threads_;
+  // "cpu" or "cuda"
+  std::string scan_matcher_backend_;
   double xmin_;
   double ymin_;
   double xmax_;
@@ -0,0 +1,92 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+#include "stage_statistics.hpp"
+
+#include <algorithm>
+
+void StageHistogram::record(std::chrono::steady_clock::duration duration)
+{
+  const int64_t micros =
+    std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+  const uint64_t value = micros > 0 ? micros : 0;
+  buckets_[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+  uint64_t max = max_micros_.load(std::memory_order_relaxed);
+  while (value > max &&
+    !max_micros_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+  {
+  }
+}
+
+StageHistogram::Summary StageHistogram::takeSummary()
+{
+  std::array<uint32_t, kBuckets> counts;
+  Summary summary;
+  for (size_t i = 0; i < kBuckets; ++i) {
+    counts[i] = buckets_[i].exchange(0, std::memory_order_relaxed);
+    summary.count += counts[i];
+  }
+  summary.max = max_micros_.exchange(0, std::memory_order_relaxed) * 1e-3;
+  if (!summary.count) {
+    return summary;
+  }
+
+  const uint64_t rank50 = (summary.count * 50 + 99) / 100;
+  const uint64_t rank90 = (summary.count * 90 + 99) / 100;
+  const uint64_t rank99 = (summary.count * 99 + 99) / 100;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; ++i) {
+    if (!counts[i]) {
+      continue;
+    }
+    const uint64_t before = seen;
+    seen += counts[i];
+    const double value = std::min(bucketValue(i) * 1e-3, summary.max);
+    if (before < rank50 && seen >= rank50) {
+      summary.p50 = value;
+    }
+    if (before < rank90 && seen >= rank90) {
+      summary.p90 = value;
+    }
+    if (before < rank99 && seen >= rank99) {
+      summary.p99 = value;
+    }
+  }
+  return summary;
+}
+
+size_t StageHistogram::bucket(uint64_t micros)
+{
+  if (micros < 4) {
+    return micros;
+  }
+  int msb = 63;
+  while (!(micros >> msb)) {
+    --msb;
+  }
+  const size_t sub = (micros >> (msb - 2)) & 3;
+  return std::min<size_t>(4 * (msb - 1) + sub, kBuckets - 1);
+}
+
+double StageHistogram::bucketValue(size_t bucket)
+{
+  if (bucket < 4) {
+    return bucket;
+  }
+  // middle of the range [(4 + sub) << shift, (5 + sub) << shift)
+  const int shift = bucket / 4 - 1;
+  const double lower = static_cast<double>(uint64_t(4 + bucket % 4) << shift);
+  return lower + (uint64_t(1) << shift) / 2.0;
+}
@@ -0,0 +1,91 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+#ifndef STAGE_STATISTICS_HPP_
+#define STAGE_STATISTICS_HPP_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Latency histogram of one pipeline stage. Recording is a couple of relaxed
+ * atomic increments, so the scan and map threads can record while the
+ * diagnostics timer takes the summary. Buckets are log-linear (four per
+ * power of two of microseconds), which bounds the percentile error to 25%.
+ */
+class StageHistogram
+{
+public:
+  struct Summary
+  {
+    uint64_t count = 0;
+    // in milliseconds
+    double p50 = 0.0;
+    double p90 = 0.0;
+    double p99 = 0.0;
+    double max = 0.0;
+  };
+
+  void record(std::chrono::steady_clock::duration duration);
+  // Summarizes and clears what was recorded since the last call
+  Summary takeSummary();
+
+private:
+  static constexpr size_t kBuckets = 160;
+  static size_t bucket(uint64_t micros);
+  static double bucketValue(size_t bucket);
+
+  std::array<std::atomic<uint32_t>, kBuckets> buckets_{};
+  std::atomic<uint64_t> max_micros_{0};
+};
+
+// Records the lifetime of the enclosing scope
+class ScopedStageTimer
+{
+public:
+  explicit ScopedStageTimer(StageHistogram & histogram)
+  : histogram_(histogram), start_(std::chrono::steady_clock::now())
+  {
+  }
+
+  ~ScopedStageTimer()
+  {
+    histogram_.record(std::chrono::steady_clock::now() - start_);
+  }
+
+  ScopedStageTimer(const ScopedStageTimer &) = delete;
+  ScopedStageTimer & operator=(const ScopedStageTimer &) = delete;
+
+private:
+  StageHistogram & histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+/*
+ * Stage timing is compiled in with -DGMAPPING_STAGE_TIMING=ON (the default).
+ * Without it these expand to nothing and the histograms stay empty.
+ */
+#ifdef GMAPPING_STAGE_TIMING
+#define GMAPPING_TIME_STAGE(histogram) ScopedStageTimer gmapping_stage_timer(histogram)
+#define GMAPPING_RECORD_STAGE(histogram, duration) (histogram).record(duration)
+#else
+#define GMAPPING_TIME_STAGE(histogram) do {} while (0)
+#define GMAPPING_RECORD_STAGE(histogram, duration) do {} while (0)
+#endif
+
+#endif  // STAGE_STATISTICS_HPP_
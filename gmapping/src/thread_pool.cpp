@@ -0,0 +1,96 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(unsigned int num_threads)
+{
+  for (unsigned int worker = 1; worker < num_threads; ++worker) {
+    threads_.emplace_back(&ThreadPool::workerLoop, this, worker);
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+  work_cv_.notify_all();
+  for (auto & thread : threads_) {
+    thread.join();
+  }
+}
+
+unsigned int ThreadPool::size() const
+{
+  return threads_.size() + 1;
+}
+
+void ThreadPool::parallelFor(size_t count, const Task & task)
+{
+  if (threads_.empty() || count < 2) {
+    for (size_t i = 0; i < count; ++i) {
+      task(i, 0);
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task_ = &task;
+    task_count_ = count;
+    next_index_ = 0;
+    busy_workers_ = threads_.size();
+    ++generation_;
+  }
+  work_cv_.notify_all();
+
+  runTask(task, 0);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] {return busy_workers_ == 0;});
+  task_ = nullptr;
+}
+
+void ThreadPool::workerLoop(unsigned int worker)
+{
+  uint64_t seen_generation = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this, &seen_generation] {
+      return !running_ || generation_ != seen_generation;
+    });
+    if (!running_) {
+      return;
+    }
+    seen_generation = generation_;
+    const Task * task = task_;
+    lock.unlock();
+    runTask(*task, worker);
+    lock.lock();
+    if (--busy_workers_ == 0) {
+      done_cv_.notify_one();
+    }
+  }
+}
+
+void ThreadPool::runTask(const Task & task, unsigned int worker)
+{
+  for (size_t i = next_index_++; i < task_count_; i = next_index_++) {
+    task(i, worker);
+  }
+}
@@ -0,0 +1,67 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#ifndef THREAD_POOL_HPP_
+#define THREAD_POOL_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed set of worker threads running one parallel loop at a time. The
+ * calling thread takes part in every loop as worker 0.
+ */
+class ThreadPool
+{
+public:
+  // Called with the loop index and the id of the worker running it
+  using Task = std::function<void (size_t, unsigned int)>;
+
+  explicit ThreadPool(unsigned int num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool & operator=(const ThreadPool &) = delete;
+
+  // Number of workers, including the calling thread
+  unsigned int size() const;
+
+  // Runs task for every index in [0, count) and returns once all of them are done
+  void parallelFor(size_t count, const Task & task);
+
+private:
+  void workerLoop(unsigned int worker);
+  void runTask(const Task & task, unsigned int worker);
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  const Task * task_ = nullptr;
+  size_t task_count_ = 0;
+  std::atomic<size_t> next_index_{0};
+  unsigned int busy_workers_ = 0;
+  uint64_t generation_ = 0;
+  bool running_ = true;
+};
+
+#endif  // THREAD_POOL_HPP_
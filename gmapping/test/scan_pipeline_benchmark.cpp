@@ -0,0 +1,227 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+/*
+ * Benchmarks of the scan pipeline. Synthetic scans of a simulated room go
+ * through initMapper(), addScan() and updateMap() of a node that is not spun;
+ * the transforms are written straight into its TF buffer.
+ *
+ * Set GMAPPING_BENCHMARK_BAG to a rosbag2 recording to also time a full replay.
+ */
+
+#include <benchmark/benchmark.h>
+#include <rclcpp/rclcpp.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "slam_gmapping.hpp"
+#include "synthetic_room.hpp"
+
+namespace
+{
+
+double percentile(std::vector<double> samples, double p)
+{
+  if (samples.empty()) {
+    return 0.0;
+  }
+  auto nth = samples.begin() + static_cast<size_t>(p * (samples.size() - 1));
+  std::nth_element(samples.begin(), nth, samples.end());
+  return *nth;
+}
+
+void reportLatency(benchmark::State & state, const std::vector<double> & samples)
+{
+  state.counters["p50_ms"] = percentile(samples, 0.5) * 1e3;
+  state.counters["p99_ms"] = percentile(samples, 0.99) * 1e3;
+}
+
+double elapsedSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+}  // namespace
+
+// Drives the private stages of a SlamGMapping node that is fed by hand
+struct SlamGMappingBenchmark
+{
+  explicit SlamGMappingBenchmark(std::vector<rclcpp::Parameter> parameters)
+  {
+    // Process every scan, so each iteration measures a full update
+    parameters.emplace_back("linearUpdate", 0.0);
+    parameters.emplace_back("angularUpdate", 0.0);
+    node = std::make_shared<SlamGMapping>(
+      rclcpp::NodeOptions().parameter_overrides(parameters), false);
+    node->advertise();
+  }
+
+  tf2_ros::Buffer & buffer()
+  {
+    return *node->buffer;
+  }
+
+  bool initMapper(const sensor_msgs::msg::LaserScan::ConstSharedPtr & scan)
+  {
+    return node->initMapper(scan);
+  }
+
+  bool addScan(const sensor_msgs::msg::LaserScan::ConstSharedPtr & scan)
+  {
+    GMapping::OrientedPoint odom_pose;
+    return node->addScan(scan, odom_pose);
+  }
+
+  // Renders the best particle's whole trajectory from scratch
+  void rebuildMap()
+  {
+    const auto & best = node->gsp_->getParticles()[node->gsp_->getBestParticleIndex()];
+    SlamGMapping::MapUpdate update;
+    update.rebuild = true;
+    for (auto n = best.node; n; n = n->parent) {
+      update.nodes.emplace_back(n->pose, n->reading);
+    }
+    node->updateMap(update);
+  }
+
+  size_t mapCells()
+  {
+    return node->map_.map.info.width * node->map_.map.info.height;
+  }
+
+  size_t replay(const std::string & bag)
+  {
+    return node->startReplay(bag, "/scan");
+  }
+
+  std::shared_ptr<SlamGMapping> node;
+};
+
+static void BM_InitMapper(benchmark::State & state)
+{
+  SyntheticRoom room(state.range(0));
+  std::vector<double> samples;
+  for (auto _ : state) {
+    SlamGMappingBenchmark bench({});
+    room.setTransforms(bench.buffer(), 0);
+    auto scan = room.scan(0);
+    auto start = std::chrono::steady_clock::now();
+    if (!bench.initMapper(scan)) {
+      state.SkipWithError("initMapper failed");
+      break;
+    }
+    samples.push_back(elapsedSince(start));
+    state.SetIterationTime(samples.back());
+  }
+  reportLatency(state, samples);
+}
+BENCHMARK(BM_InitMapper)->Arg(360)->Arg(1080)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+// addScan() against particle count (first argument) and beam count (second argument)
+static void BM_AddScan(benchmark::State & state)
+{
+  SyntheticRoom room(state.range(1));
+  SlamGMappingBenchmark bench({rclcpp::Parameter("particles", static_cast<int>(state.range(0)))});
+  room.setTransforms(bench.buffer(), 0);
+  if (!bench.initMapper(room.scan(0))) {
+    state.SkipWithError("initMapper failed");
+    return;
+  }
+
+  std::vector<double> samples;
+  size_t step = 0;
+  for (auto _ : state) {
+    ++step;
+    room.setTransforms(bench.buffer(), step);
+    auto scan = room.scan(step);
+    auto start = std::chrono::steady_clock::now();
+    if (!bench.addScan(scan)) {
+      state.SkipWithError("addScan failed");
+      break;
+    }
+    samples.push_back(elapsedSince(start));
+    state.SetIterationTime(samples.back());
+  }
+  reportLatency(state, samples);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AddScan)
+  ->Args({10, 360})->Args({30, 360})->Args({100, 360})
+  ->Args({30, 1080})->Args({30, 3200})
+  ->UseManualTime()->Unit(benchmark::kMillisecond);
+
+// A full map rebuild from 100 scans against the size of the map in meters
+static void BM_UpdateMap(benchmark::State & state)
+{
+  const double half_size = state.range(0) / 2.0;
+  SyntheticRoom room(360);
+  SlamGMappingBenchmark bench({
+    rclcpp::Parameter("xmin", -half_size), rclcpp::Parameter("ymin", -half_size),
+    rclcpp::Parameter("xmax", half_size), rclcpp::Parameter("ymax", half_size)});
+  room.setTransforms(bench.buffer(), 0);
+  if (!bench.initMapper(room.scan(0))) {
+    state.SkipWithError("initMapper failed");
+    return;
+  }
+  for (size_t step = 1; step <= 100; ++step) {
+    room.setTransforms(bench.buffer(), step);
+    bench.addScan(room.scan(step));
+  }
+
+  std::vector<double> samples;
+  for (auto _ : state) {
+    auto start = std::chrono::steady_clock::now();
+    bench.rebuildMap();
+    samples.push_back(elapsedSince(start));
+    state.SetIterationTime(samples.back());
+  }
+  reportLatency(state, samples);
+  state.counters["cells"] = bench.mapCells();
+}
+BENCHMARK(BM_UpdateMap)->Arg(20)->Arg(50)->Arg(100)->Arg(200)
+  ->UseManualTime()->Unit(benchmark::kMillisecond);
+
+static void BM_ReplayBag(benchmark::State & state)
+{
+  const char * bag = std::getenv("GMAPPING_BENCHMARK_BAG");
+  if (!bag) {
+    state.SkipWithError("GMAPPING_BENCHMARK_BAG is not set");
+    return;
+  }
+  size_t scans = 0;
+  for (auto _ : state) {
+    SlamGMappingBenchmark bench({});
+    scans += bench.replay(bag);
+  }
+  state.SetItemsProcessed(scans);
+}
+BENCHMARK(BM_ReplayBag)->Iterations(1)->Unit(benchmark::kSecond);
+
+int main(int argc, char ** argv)
+{
+  rclcpp::init(argc, argv);
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  rclcpp::shutdown();
+  return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#ifndef SYNTHETIC_ROOM_HPP_
+#define SYNTHETIC_ROOM_HPP_
+
+#include <builtin_interfaces/msg/time.hpp>
+#include <geometry_msgs/msg/transform_stamped.hpp>
+#include <sensor_msgs/msg/laser_scan.hpp>
+#include <tf2/LinearMath/Quaternion.h>
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+#include <tf2_ros/buffer.h>
+
+/* OpenSLAM GMapping */
+#include <gmapping/utils/point.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+
+// A 20 x 20 m room with a few boxes in it; the robot drives a circle around the center
+class SyntheticRoom
+{
+public:
+  explicit SyntheticRoom(int beams)
+  : beams_(beams)
+  {
+  }
+
+  GMapping::OrientedPoint pose(size_t step) const
+  {
+    const double a = step * 0.02;
+    return GMapping::OrientedPoint(3.0 * std::cos(a), 3.0 * std::sin(a), a + M_PI / 2);
+  }
+
+  // Scans come at 20 Hz, starting at t = 1 s
+  builtin_interfaces::msg::Time stamp(size_t step) const
+  {
+    builtin_interfaces::msg::Time t;
+    t.sec = 1 + step / 20;
+    t.nanosec = (step % 20) * 50000000;
+    return t;
+  }
+
+  void setTransforms(tf2_ros::Buffer & buffer, size_t step) const
+  {
+    geometry_msgs::msg::TransformStamped laser;
+    laser.header.stamp = stamp(step);
+    laser.header.frame_id = "base_link";
+    laser.child_frame_id = "base_scan";
+    laser.transform.translation.x = kLaserOffset;
+    laser.transform.rotation.w = 1.0;
+    buffer.setTransform(laser, "benchmark", true);
+
+    const GMapping::OrientedPoint p = pose(step);
+    tf2::Quaternion q;
+    q.setRPY(0.0, 0.0, p.theta);
+    geometry_msgs::msg::TransformStamped odom;
+    odom.header.stamp = stamp(step);
+    odom.header.frame_id = "odom";
+    odom.child_frame_id = "base_link";
+    odom.transform.translation.x = p.x;
+    odom.transform.translation.y = p.y;
+    odom.transform.rotation = tf2::toMsg(q);
+    buffer.setTransform(odom, "benchmark", false);
+  }
+
+  sensor_msgs::msg::LaserScan::ConstSharedPtr scan(size_t step) const
+  {
+    auto scan = std::make_shared<sensor_msgs::msg::LaserScan>();
+    scan->header.stamp = stamp(step);
+    scan->header.frame_id = "base_scan";
+    scan->angle_min = -3 * M_PI / 4;
+    scan->angle_max = 3 * M_PI / 4;
+    scan->angle_increment = (scan->angle_max - scan->angle_min) / (beams_ - 1);
+    scan->range_min = 0.1;
+    scan->range_max = 30.0;
+
+    const GMapping::OrientedPoint p = pose(step);
+    const double ox = p.x + kLaserOffset * std::cos(p.theta);
+    const double oy = p.y + kLaserOffset * std::sin(p.theta);
+    scan->ranges.resize(beams_);
+    for (int i = 0; i < beams_; ++i) {
+      const double a = p.theta + scan->angle_min + i * scan->angle_increment;
+      scan->ranges[i] = castRay(ox, oy, std::cos(a), std::sin(a));
+    }
+    return scan;
+  }
+
+private:
+  struct Box
+  {
+    double x0, y0, x1, y1;
+  };
+
+  // Distance along the ray to the box boundary; the exit distance if the ray starts inside
+  static double hit(const Box & b, double ox, double oy, double dx, double dy, bool inside)
+  {
+    const double inf = std::numeric_limits<double>::infinity();
+    double tx0 = dx != 0 ? (b.x0 - ox) / dx : -inf, tx1 = dx != 0 ? (b.x1 - ox) / dx : inf;
+    double ty0 = dy != 0 ? (b.y0 - oy) / dy : -inf, ty1 = dy != 0 ? (b.y1 - oy) / dy : inf;
+    if (tx0 > tx1) {std::swap(tx0, tx1);}
+    if (ty0 > ty1) {std::swap(ty0, ty1);}
+    const double t_near = std::max(tx0, ty0);
+    const double t_far = std::min(tx1, ty1);
+    if (inside) {
+      return t_far;
+    }
+    return (t_near <= t_far && t_near > 0) ? t_near : inf;
+  }
+
+  float castRay(double ox, double oy, double dx, double dy) const
+  {
+    double range = hit(room_, ox, oy, dx, dy, true);
+    for (const Box & b : obstacles_) {
+      range = std::min(range, hit(b, ox, oy, dx, dy, false));
+    }
+    return static_cast<float>(range);
+  }
+
+  static constexpr double kLaserOffset = 0.1;
+  const Box room_{-10, -10, 10, 10};
+  const std::vector<Box> obstacles_{{-6, -6, -4, -4}, {4, -7, 6, -3}, {-2, 5, 2, 6}, {6, 6, 7, 9}};
+  int beams_;
+};
+
+#endif  // SYNTHETIC_ROOM_HPP_
@@ -0,0 +1,208 @@
+/*
+ * slam_gmapping
+ * Copyright (c) 2017, Open Source Robotics Foundation, Inc.
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+/*
+ * Tests of the scan pipeline on synthetic scans, driven through the private stages
+ * of a node that is not spun, as in the benchmarks.
+ */
+
+#include <gtest/gtest.h>
+#include <rclcpp/rclcpp.hpp>
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "allocation_counter.hpp"
+#include "slam_gmapping.hpp"
+#include "synthetic_room.hpp"
+
+// Drives the private stages of a SlamGMapping node that is fed by hand
+struct SlamGMappingTest
+{
+  explicit SlamGMappingTest(std::vector<rclcpp::Parameter> parameters)
+  {
+    // Process every scan
+    parameters.emplace_back("linearUpdate", 0.0);
+    parameters.emplace_back("angularUpdate", 0.0);
+    node = std::make_shared<SlamGMapping>(
+      rclcpp::NodeOptions().parameter_overrides(parameters), false);
+    node->advertise();
+  }
+
+  bool initMapper(const SyntheticRoom & room, size_t step)
+  {
+    room.setTransforms(*node->buffer, step);
+    return node->initMapper(room.scan(step));
+  }
+
+  bool addScan(const SyntheticRoom & room, size_t step)
+  {
+    room.setTransforms(*node->buffer, step);
+    GMapping::OrientedPoint odom_pose;
+    return node->addScan(room.scan(step), odom_pose);
+  }
+
+  // Renders the best particle's trajectory and saves it as the map builder would
+  void writeCheckpoint()
+  {
+    const auto & best = node->gsp_->getParticles()[node->gsp_->getBestParticleIndex()];
+    SlamGMapping::MapUpdate update;
+    update.rebuild = true;
+    for (auto n = best.node; n; n = n->parent) {
+      update.nodes.emplace_back(n->pose, n->reading);
+    }
+    update.pose = best.pose;
+    update.odom_pose = node->gsp_->odometryPose();
+    node->updateMap(update);
+    node->writeCheckpoint(update);
+  }
+
+  size_t trajectoryNodeCount() const
+  {
+    return node->gsp_->trajectoryNodeCount();
+  }
+
+  size_t readingCount() const
+  {
+    return node->gsp_->readingCount();
+  }
+
+  // Stands in for the map builder, which frees the pruned scans once they are in the base map
+  void dropPrunedScans()
+  {
+    node->pruned_scans_.clear();
+  }
+
+  bool matchesOnDevice() const
+  {
+    return node->gsp_->matcherBackend() == ParallelGridSlamProcessor::MatcherBackend::kCuda;
+  }
+
+  GMapping::OrientedPoint bestPose() const
+  {
+    return node->gsp_->getParticles()[node->gsp_->getBestParticleIndex()].pose;
+  }
+
+  const SlamGMapping::ScanAllocations & allocations() const
+  {
+    return node->scan_allocations_;
+  }
+
+  std::shared_ptr<SlamGMapping> node;
+};
+
+TEST(SlamGMapping, ResamplesAfterResume)
+{
+  const std::string checkpoint = testing::TempDir() + "gmapping_resume_test.ckpt";
+  const int particles = 10;
+  SyntheticRoom room(360);
+  size_t step = 0;
+  {
+    SlamGMappingTest session({
+      rclcpp::Parameter("particles", particles),
+      rclcpp::Parameter("checkpoint_file", checkpoint),
+      rclcpp::Parameter("checkpoint_interval", 0.0)});
+    ASSERT_TRUE(session.initMapper(room, step));
+    for (++step; step <= 20; ++step) {
+      ASSERT_TRUE(session.addScan(room, step));
+    }
+    session.writeCheckpoint();
+  }
+
+  // Resample on every scan, so particles are dropped from the first scan on
+  SlamGMappingTest resumed({
+    rclcpp::Parameter("particles", particles),
+    rclcpp::Parameter("resampleThreshold", 2.0),
+    rclcpp::Parameter("resume_from", checkpoint)});
+  ASSERT_TRUE(resumed.initMapper(room, step));
+  const size_t scans = 40;
+  for (size_t i = 0; i < scans; ++i) {
+    ASSERT_TRUE(resumed.addScan(room, ++step));
+  }
+  // Releasing a node twice would throw the pool's count off
+  EXPECT_GT(resumed.trajectoryNodeCount(), 0u);
+  EXPECT_LE(resumed.trajectoryNodeCount(), particles * (scans + 1) + 1);
+  std::remove(checkpoint.c_str());
+}
+
+TEST(SlamGMapping, ReusesScanBuffers)
+{
+  // The test links the node built with GMAPPING_COUNT_ALLOCATIONS
+  ASSERT_TRUE(allocation_counter::enabled());
+  SyntheticRoom room(360);
+  SlamGMappingTest session({
+    rclcpp::Parameter("particles", 10),
+    rclcpp::Parameter("resampleThreshold", 2.0),
+    rclcpp::Parameter("prune_trajectory", true)});
+  size_t step = 0;
+  ASSERT_TRUE(session.initMapper(room, step));
+  for (++step; step <= 20; ++step) {
+    ASSERT_TRUE(session.addScan(room, step));
+    session.dropPrunedScans();
+  }
+
+  const size_t readings = session.readingCount();
+  const size_t scans = 100;
+  for (size_t i = 0; i < scans; ++i) {
+    ASSERT_TRUE(session.addScan(room, ++step));
+    session.dropPrunedScans();
+    // The beams go through buffers sized in initMapper()
+    EXPECT_EQ(session.allocations().reading, 0u) << "at scan " << step;
+  }
+  // Without the pool every processed scan would allocate a reading for the tree
+  EXPECT_LT(session.readingCount() - readings, scans / 2);
+}
+
+TEST(SlamGMapping, MatchesOnTheDevice)
+{
+  SyntheticRoom room(360);
+  auto parameters = [](const std::string & backend) {
+      return std::vector<rclcpp::Parameter>{
+        rclcpp::Parameter("particles", 30),
+        rclcpp::Parameter("seed", 7),
+        rclcpp::Parameter("scan_matcher_backend", backend)};
+    };
+  SlamGMappingTest cpu(parameters("cpu"));
+  SlamGMappingTest cuda(parameters("cuda"));
+  size_t step = 0;
+  ASSERT_TRUE(cpu.initMapper(room, step));
+  ASSERT_TRUE(cuda.initMapper(room, step));
+  if (!cuda.matchesOnDevice()) {
+    GTEST_SKIP() << "Built without GMAPPING_CUDA or no CUDA device";
+  }
+
+  // The same seed draws the same motion noise, so only the scores can set the runs apart
+  for (++step; step <= 60; ++step) {
+    ASSERT_TRUE(cpu.addScan(room, step));
+    ASSERT_TRUE(cuda.addScan(room, step));
+    const GMapping::OrientedPoint expected = cpu.bestPose();
+    const GMapping::OrientedPoint actual = cuda.bestPose();
+    EXPECT_NEAR(actual.x, expected.x, 1e-3) << "at scan " << step;
+    EXPECT_NEAR(actual.y, expected.y, 1e-3) << "at scan " << step;
+    EXPECT_NEAR(actual.theta, expected.theta, 1e-3) << "at scan " << step;
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  rclcpp::init(argc, argv);
+  testing::InitGoogleTest(&argc, argv);
+  const int result = RUN_ALL_TESTS();
+  rclcpp::shutdown();
+  return result;
+}